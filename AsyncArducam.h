@@ -23,7 +23,7 @@
 #include "memorysaver.h"
 #include <math.h>
 
-#include "SyncedMemoryBuffer.h"
+#include "FrameWriter.h"
 #include "Task.h"
 
 const int VCS = 5;
@@ -38,12 +38,14 @@ class AsyncArducam : public ArduCAM, public Task
 private:
   bool cameraReady = false;
   uint32_t lastCaptureStart = 0;
+  uint32_t lastCaptureStartMicros = 0;
+  uint32_t lastCaptureDoneMicros = 0;
   uint16_t lastCaptureDuration = 200;
   uint32_t lastCopyStart = 0;
   bool captureStarted = false;
   bool copyActive = false;
   uint32_t currentDataInCamera = 0;
-  uint32_t currentlyCopied = 0;
+  FrameWriter writer;
   uint8_t ffsOnLine = 0;
   uint32_t semaphoreWaitStartTime = 0;
   bool writtenSemaphoreError = false;
@@ -97,9 +99,8 @@ public:
       return;
 
     while (true) {
-      uint32_t loopStart = millis();
-      
       if (captureStarted && !isCaptureActive()) {
+        lastCaptureDoneMicros = micros();
         lastCaptureDuration = millis() - lastCaptureStart;
         if (lastCaptureDuration > 300) {
           Serial.print("C" + String(lastCaptureDuration) + " ");
@@ -117,11 +118,13 @@ public:
       
       if (copyActive) {
         copyDataToBuffer();
+        // a copy takes longer than a period (ie 30ms for 30kb); only the polling of the capture is periodic
+        restartPeriods();
       } else if (!captureStarted) {
         initiateCapture();
       }
       
-      sleepAfterLoop(10, loopStart);
+      waitForNextPeriod(10000);
     }
   }
 
@@ -160,6 +163,7 @@ private:
     uint32_t now = millis();
     //Serial.print("D"+String(now-lastCaptureStart)+" ");
     lastCaptureStart = now;
+    lastCaptureStartMicros = micros();
     
     clear_fifo_flag();
     start_capture();
@@ -173,7 +177,6 @@ private:
     copyActive = true;
 
     currentDataInCamera = 0;
-    currentlyCopied = 0;
 
     lastCopyStart = millis();
   }
@@ -193,8 +196,18 @@ private:
     bool oneIsNewer = buffer1->hasContent() && buffer1->timestamp() >= buffer2->timestamp();
 
     SyncedMemoryBuffer* buffer = oneIsNewer ? buffer2 : buffer1;
+    SyncedMemoryBuffer* otherBuffer = oneIsNewer ? buffer1 : buffer2;
+
+    // don't overwrite a buffer that is still being sent; rather replace the newer frame
+    if (buffer->isPinned() && !otherBuffer->isPinned()) {
+      buffer = otherBuffer;
+    }
 
     bool hasCopySemaphore = buffer->take("cam", 20 / portTICK_PERIOD_MS);
+    if (hasCopySemaphore && buffer->isPinned()) {
+      buffer->release();
+      hasCopySemaphore = false;
+    }
 
     if (!hasCopySemaphore) {
       if (millis() - semaphoreWaitStartTime > 2000 && !writtenSemaphoreError) {
@@ -234,16 +247,14 @@ private:
       // this is true for my OV2640_CAM; discards the one surplus 0-byte at the beginning
       SPI.transfer(0xFF);
       #endif
+
+      // the server may start sending before the copy is done
+      writer.begin(buffer, currentDataInCamera, lastCaptureStart);
     }
     
-    uint32_t maximumToCopy = _min(buffer->maxSize(), currentDataInCamera);
-    while (currentlyCopied < maximumToCopy) {
-      byte* bufferPointer = &((buffer->content())[currentlyCopied]);
-      uint32_t bytesToCopyLeft = maximumToCopy - currentlyCopied;
-      uint16_t copyNow = _min(2048, bytesToCopyLeft);
-
-      SPI.transferBytes(bufferPointer, bufferPointer, copyNow);
-      currentlyCopied += copyNow;
+    while (!writer.isDone()) {
+      SPI.transferBytes(writer.chunk(), writer.chunk(), writer.chunkSize());
+      writer.commit();
 
       // Don't copy in one go (would block for ie 30ms for 30kb - SPI 8Mhz)
       yield();
@@ -251,7 +262,13 @@ private:
       
     CS_HIGH();
     currentDataInCamera = 0;
-    buffer->release(maximumToCopy, lastCaptureStart);
+
+    FrameTrace* trace = buffer->trace();
+    trace->captureStart = lastCaptureStartMicros;
+    trace->captureDone = lastCaptureDoneMicros;
+    trace->copyDone = micros();
+
+    writer.finish(lastCaptureStart);
     copyActive = false;
   }
 };
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __CHANNEL_SELECTOR_H__
+#define __CHANNEL_SELECTOR_H__
+
+#include <stdint.h>
+
+/**
+ * Scores the 2.4GHz channels by the networks found in a scan and picks the least congested one.
+ *
+ * A 20MHz channel overlaps the four channels on either side, so a network counts on its own channel
+ * fully and less with every channel of distance. Stronger networks count more (they are more likely
+ * to block the air); every network counts a bit (beacons alone need airtime).
+ *
+ * Has no WiFi dependency: the scan is done by the caller (and recorded scans can be fed on the host;
+ * see tools/channel_scan.cpp).
+ */
+class ChannelSelector
+{
+public:
+  static const uint8_t MAX_CHANNEL = 13;
+  static const uint8_t OVERLAP_DISTANCE = 5; // channels this far apart don't overlap
+  static const uint16_t NETWORK_BASE_WEIGHT = 10;
+  static const int8_t RSSI_FLOOR = -100;
+  static const uint16_t RSSI_MAX_WEIGHT = 70; // from -30dBm everything is equally loud
+
+private:
+  uint32_t scores[MAX_CHANNEL + 1];
+  uint16_t networkCounts[MAX_CHANNEL + 1];
+  uint8_t highestChannel;
+
+public:
+  /**
+   * @param highest channel to consider (11 is safe for clients of all regions)
+   */
+  ChannelSelector(uint8_t highest = 11)
+  {
+    highestChannel = highest < 1 ? 1 : (highest > MAX_CHANNEL ? MAX_CHANNEL : highest);
+    clear();
+  }
+
+  void clear()
+  {
+    for (uint8_t c = 0; c <= MAX_CHANNEL; c++) {
+      scores[c] = 0;
+      networkCounts[c] = 0;
+    }
+  }
+
+  /**
+   * Adds one network of the scan; unknown channels (ie 5GHz) are ignored.
+   */
+  void addNetwork(int32_t channel, int32_t rssi)
+  {
+    if (channel < 1 || channel > MAX_CHANNEL) {
+      return;
+    }
+
+    networkCounts[channel]++;
+
+    uint32_t weight = NETWORK_BASE_WEIGHT + rssiWeight(rssi);
+    for (uint8_t c = 1; c <= MAX_CHANNEL; c++) {
+      uint8_t distance = c > channel ? c - channel : channel - c;
+      if (distance < OVERLAP_DISTANCE) {
+        scores[c] += weight * (OVERLAP_DISTANCE - distance);
+      }
+    }
+  }
+
+  /**
+   * Congestion of the channel; lower is better.
+   */
+  uint32_t score(uint8_t channel) const
+  {
+    return channel < 1 || channel > MAX_CHANNEL ? UINT32_MAX : scores[channel];
+  }
+
+  uint16_t networkCount(uint8_t channel) const
+  {
+    return channel < 1 || channel > MAX_CHANNEL ? 0 : networkCounts[channel];
+  }
+
+  /**
+   * The channel with the lowest score; on a tie one of the non-overlapping channels 1, 6, 11
+   * (neighbours are then less likely to move onto our channel).
+   */
+  uint8_t bestChannel() const
+  {
+    static const uint8_t preferred[] = { 1, 6, 11 };
+
+    uint8_t best = 0;
+    for (uint8_t i = 0; i < sizeof(preferred); i++) {
+      best = better(best, preferred[i]);
+    }
+    for (uint8_t c = 1; c <= highestChannel; c++) {
+      best = better(best, c);
+    }
+
+    return best;
+  }
+
+  /**
+   * Only a clearly better channel is worth the disruption of a switch (clients must reconnect).
+   */
+  bool isWorthSwitching(uint8_t currentChannel) const
+  {
+    uint8_t best = bestChannel();
+    return best != currentChannel && (uint64_t)score(best) * 4 < (uint64_t)score(currentChannel) * 3;
+  }
+
+private:
+  static uint16_t rssiWeight(int32_t rssi)
+  {
+    if (rssi <= RSSI_FLOOR) {
+      return 0;
+    }
+    uint32_t weight = rssi - RSSI_FLOOR;
+    return weight > RSSI_MAX_WEIGHT ? RSSI_MAX_WEIGHT : weight;
+  }
+
+  uint8_t better(uint8_t best, uint8_t candidate) const
+  {
+    if (candidate > highestChannel) {
+      return best;
+    }
+    return best == 0 || scores[candidate] < scores[best] ? candidate : best;
+  }
+};
+
+#endif
@@ -18,37 +18,33 @@
 #define __CONTINUOUS_CONTROL_H__
 
 #include "StepperMotors.h"
+#include "VoltageSampler.h"
+#include "WifiLinkSettings.h"
 
 class ContinuousControl
 {
 private:
-  const int VOLTAGE_PIN = 34;
-
   StepperMotors* motor;
-
-  uint32_t lastVoltageReadMillis = 0;
-  float lastReadVoltage = 0;
-  uint16_t lastVoltageRaw = 0;
+  VoltageSampler* voltageSampler;
+  WifiLinkSettings* linkSettings;
 
 public:
-  ContinuousControl(StepperMotors* m)
+  ContinuousControl(StepperMotors* m, VoltageSampler* v, WifiLinkSettings* l = NULL)
   {
     motor = m;
-
-    // TODO adcAttachPin()? pinMode(,INPUT)?
-
-    // NOTE using anything other than 10 bit and 0 db leads to radically worse values
-    analogReadResolution(10); // now range is 0..1023
-    analogSetPinAttenuation(VOLTAGE_PIN, ADC_0db); // metering range 1.1 volts
+    voltageSampler = v;
+    linkSettings = l;
   }
 
   bool supports(String requested) {
     return requested.startsWith("move ")
+        || requested.startsWith("path ")
         || requested.startsWith("left ")
         || requested.startsWith("right ")
         || requested.startsWith("fore ")
         || requested.startsWith("back ")
-        || requested.startsWith("status");
+        || requested.startsWith("status")
+        || (linkSettings != NULL && linkSettings->supports(requested));
   }
 
   String handle(String requested) {
@@ -83,6 +79,44 @@ public:
         
         return "";
       }
+    } else if (requested.startsWith("path ")) {
+      // Triples of: millis from now, right speed, left speed (both 0..1000 for the range of -1 .. 1)
+      String numberPart = requested.substring(5);
+      uint32_t now = millis();
+      uint8_t accepted = 0;
+      uint32_t start = 0;
+      while (start < numberPart.length()) {
+        long values[3];
+        uint8_t valueCount = 0;
+        while (valueCount < 3 && start < numberPart.length()) {
+          int idx = numberPart.indexOf(' ', start);
+          if (idx < 0) {
+            idx = numberPart.length();
+          }
+          values[valueCount++] = numberPart.substring(start, idx).toInt();
+          start = idx + 1;
+        }
+
+        if (valueCount < 3) {
+          Serial.println("\nIgnoring incomplete path point "+numberPart);
+          break;
+        }
+
+        float r = (values[1] / 1000.0f - 0.5f) * 2;
+        float l = (values[2] / 1000.0f - 0.5f) * 2;
+
+        if (values[0] < 0 || r > 1 || r < -1 || l > 1 || l < -1) {
+          Serial.println("\nIgnoring bogus path value(s) "+String(values[0])+","+String(r)+","+String(l));
+          break;
+        }
+        
+        if (!motor->requestTrajectoryPoint(now + values[0], r, l)) {
+          break;
+        }
+        accepted++;
+      }
+
+      return "OKP "+String(accepted)+" "+String(motor->trajectoryDepth());
     } else if (requested.startsWith("left ")
       || requested.startsWith("right ")
       || requested.startsWith("fore ")
@@ -113,20 +147,21 @@ public:
 
       return "OKC"+String(v);
     } else if (requested.startsWith("status")) {
-      float voltage = lastReadVoltage;
-      if (lastVoltageReadMillis == 0 || millis() - lastVoltageReadMillis > 1000) {
-        voltage = readVoltage();
+      if (!voltageSampler->hasReading()) {
+        return "VOLT unknown";
       }
-      
-      return "VOLT "+String(voltage,2)+" from "+String(lastVoltageRaw);
+      return "VOLT "+String(voltageSampler->currentVoltage(),2)+" from "+String(voltageSampler->currentRaw())
+        +" age "+String(voltageSampler->readingAge())+"ms";
+    } else if (linkSettings != NULL && linkSettings->supports(requested)) {
+      return linkSettings->handle(requested);
     } else {
       return "";
     }
   }
 
-  void triggerVoltageReading()
+  void noteTransmission()
   {
-    readVoltage();
+    voltageSampler->noteTransmission();
   }
 
 private:
@@ -135,25 +170,6 @@ private:
       long v = requestValueString.toInt();
       return v / 1000.0f;
   }
-  
-  float readVoltage()
-  {
-    lastVoltageReadMillis = millis();
-    
-    lastVoltageRaw = analogRead(VOLTAGE_PIN);
-
-    float bridgeFactor = (370.0f + 82) / 82;//(384.0f + 81) / 81; // another board (266.0f + 80) / 80;
-    float refVoltage = 1.1f;
-    float maxValue = 1023.0f;
-    float measureVoltage = lastVoltageRaw / maxValue * refVoltage;
-
-    //Serial.print("V: "+String(measureVoltage)+" "+String(lastVoltageRaw)+","+String(lastVoltageRaw2)+" ");
-    // 4.2 volts then corresponds to 0.97 volts measured
-    
-    lastReadVoltage = measureVoltage * bridgeFactor;
-
-    return lastReadVoltage;
-  }
 };
 
 #endif
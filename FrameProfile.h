@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __FRAME_PROFILE_H__
+#define __FRAME_PROFILE_H__
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Coarse shape of a JPEG: the lengths of its entropy-coded segments between restart markers
+ * (RST0..RST7), summed into at most MAX_BANDS bands of image rows.
+ *
+ * Sensor noise changes the compressed bytes everywhere (so no hash of them matches), but it changes
+ * the segment lengths only a little; a change of the scene changes those of its region a lot.
+ * Built while the frame is copied (in chunks); without restart markers it stays empty.
+ */
+class FrameProfile
+{
+public:
+  static const uint8_t MAX_BANDS = 32;
+
+private:
+  uint32_t bands[MAX_BANDS];
+  uint8_t bandCount = 0;
+  uint16_t segmentsPerBand = 1;
+  uint16_t segmentsInLastBand = 0;
+  uint32_t position = 0;
+  uint32_t lastMarker = 0;
+  bool afterFf = false;
+
+public:
+  void reset()
+  {
+    bandCount = 0;
+    segmentsPerBand = 1;
+    segmentsInLastBand = 0;
+    position = 0;
+    lastMarker = 0;
+    afterFf = false;
+  }
+
+  /**
+   * The next bytes of the frame.
+   */
+  void scan(const uint8_t* data, uint32_t length)
+  {
+    uint32_t start = position;
+    if (afterFf && length > 0) {
+      checkMarker(data[0], start);
+    }
+
+    const uint8_t* end = data + length;
+    const uint8_t* ff = (const uint8_t*)memchr(data, 0xff, length);
+    while (ff != NULL && ff + 1 < end) {
+      checkMarker(ff[1], start + (ff + 1 - data));
+      ff = (const uint8_t*)memchr(ff + 1, 0xff, end - ff - 1);
+    }
+
+    afterFf = ff != NULL;
+    position += length;
+  }
+
+  /**
+   * Closes the last segment; the frame ends here.
+   */
+  void finish()
+  {
+    if (bandCount > 0) {
+      addSegment(position - lastMarker);
+    }
+  }
+
+  uint8_t count() const
+  {
+    return bandCount;
+  }
+
+  /**
+   * Same number of segments and every band within tolerance (per mille of the larger one).
+   */
+  bool isSimilar(const FrameProfile& other, uint16_t tolerancePerMille) const
+  {
+    if (bandCount < 2 || bandCount != other.bandCount || segmentsPerBand != other.segmentsPerBand
+        || segmentsInLastBand != other.segmentsInLastBand) {
+      return false;
+    }
+
+    for (uint8_t i = 0; i < bandCount; i++) {
+      uint32_t larger = bands[i] > other.bands[i] ? bands[i] : other.bands[i];
+      uint32_t difference = bands[i] > other.bands[i] ? bands[i] - other.bands[i] : other.bands[i] - bands[i];
+      if ((uint64_t)difference * 1000 > (uint64_t)larger * tolerancePerMille) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+private:
+  /**
+   * @param markerEnd position of the byte after 0xff
+   */
+  void checkMarker(uint8_t marker, uint32_t markerEnd)
+  {
+    if (marker >= 0xd0 && marker <= 0xd7) {
+      addSegment(markerEnd - 1 - lastMarker);
+      lastMarker = markerEnd - 1;
+    }
+  }
+
+  void addSegment(uint32_t length)
+  {
+    if (bandCount > 0 && segmentsInLastBand < segmentsPerBand) {
+      bands[bandCount - 1] += length;
+      segmentsInLastBand++;
+      return;
+    }
+
+    if (bandCount == MAX_BANDS) {
+      // all bands are full: halve the resolution
+      for (uint8_t i = 0; i < MAX_BANDS / 2; i++) {
+        bands[i] = bands[2 * i] + bands[2 * i + 1];
+      }
+      bandCount = MAX_BANDS / 2;
+      segmentsPerBand *= 2;
+    }
+
+    bands[bandCount++] = length;
+    segmentsInLastBand = 1;
+  }
+};
+
+#endif
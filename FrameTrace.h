@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __FRAME_TRACE_H__
+#define __FRAME_TRACE_H__
+
+/**
+ * Timestamps (micros) of the stages one frame passes from camera to network.
+ */
+struct FrameTrace
+{
+  uint32_t captureStart = 0;
+  uint32_t captureDone = 0; // NOTE only detected with the polling interval of the camera task
+  uint32_t copyDone = 0;
+  uint32_t published = 0;
+  uint32_t firstSent = 0;
+  uint32_t lastSent = 0;
+};
+
+/**
+ * Collects the durations of the frame stages in histograms with power of two buckets.
+ */
+class FrameTraceStats
+{
+public:
+  enum Stage { CAPTURE, COPY, PUBLISH, WAIT, SEND, TOTAL, STAGE_COUNT };
+
+private:
+  // bucket i counts durations below 2^i micros (from 2^(i-1) on); the last one all from 2^20 (about 1 second) on
+  static const uint8_t BUCKET_COUNT = 22;
+
+  uint32_t buckets[STAGE_COUNT][BUCKET_COUNT];
+  uint64_t sums[STAGE_COUNT];
+  uint32_t maxima[STAGE_COUNT];
+  uint32_t frameCount = 0;
+
+public:
+  FrameTraceStats()
+  {
+    reset();
+  }
+
+  void reset()
+  {
+    memset(buckets, 0, sizeof(buckets));
+    memset(sums, 0, sizeof(sums));
+    memset(maxima, 0, sizeof(maxima));
+    frameCount = 0;
+  }
+
+  void record(const FrameTrace* trace)
+  {
+    if (trace->captureStart == 0 || trace->lastSent == 0) {
+      return;
+    }
+    
+    add(CAPTURE, elapsed(trace->captureStart, trace->captureDone));
+    add(COPY, elapsed(trace->captureDone, trace->copyDone));
+    add(PUBLISH, elapsed(trace->copyDone, trace->published));
+    add(WAIT, elapsed(trace->published, trace->firstSent)); // 0 with cut-through
+    add(SEND, elapsed(trace->firstSent, trace->lastSent));
+    add(TOTAL, elapsed(trace->captureStart, trace->lastSent));
+    frameCount++;
+  }
+
+  /**
+   * Per stage: average, median, 90% (interpolated inside their buckets) and maximum in micros.
+   */
+  String toString()
+  {
+    const char* names[STAGE_COUNT] = { "cap", "copy", "pub", "wait", "send", "total" };
+    
+    String result = "frames "+String(frameCount);
+    if (frameCount == 0) {
+      return result;
+    }
+    
+    for (uint8_t stage = 0; stage < STAGE_COUNT; stage++) {
+      result += " "+String(names[stage]);
+      result += " "+String((uint32_t)(sums[stage] / frameCount));
+      result += "/"+String(percentile(stage, 50));
+      result += "/"+String(percentile(stage, 90));
+      result += "/"+String(maxima[stage]);
+    }
+
+    return result;
+  }
+
+private:
+  static uint32_t elapsed(uint32_t from, uint32_t to)
+  {
+    return (int32_t)(to - from) > 0 ? to - from : 0;
+  }
+
+  void add(uint8_t stage, uint32_t micros)
+  {
+    uint8_t bucket = 0;
+    while (bucket < BUCKET_COUNT - 1 && micros >= (1UL << bucket)) {
+      bucket++;
+    }
+
+    buckets[stage][bucket]++;
+    sums[stage] += micros;
+    maxima[stage] = _max(maxima[stage], micros);
+  }
+
+  /**
+   * Bucket n holds [2^(n-1), 2^n); the values are assumed to be spread evenly inside.
+   */
+  uint32_t percentile(uint8_t stage, uint8_t percent)
+  {
+    uint32_t wanted = (frameCount * percent + 99) / 100;
+    uint32_t seen = 0;
+    for (uint8_t bucket = 0; bucket < BUCKET_COUNT; bucket++) {
+      uint32_t inBucket = buckets[stage][bucket];
+      if (seen + inBucket >= wanted && inBucket > 0) {
+        uint32_t lower = bucket == 0 ? 0 : (1UL << (bucket - 1));
+        uint32_t upper = _min(bucket < BUCKET_COUNT - 1 ? (1UL << bucket) : maxima[stage], maxima[stage]);
+        if (upper <= lower) {
+          return upper;
+        }
+        return lower + (uint64_t)(upper - lower) * (wanted - seen) / inBucket;
+      }
+      seen += inBucket;
+    }
+
+    return maxima[stage];
+  }
+};
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __FRAME_WRITER_H__
+#define __FRAME_WRITER_H__
+
+#include "SyncedMemoryBuffer.h"
+
+/**
+ * Writes a frame into a buffer in chunks (while readers already send its beginning) and
+ * builds its fingerprint and profile on the way.
+ *
+ * A chunk is read (ie from SPI) into chunk(); for a buffer in PSRAM that is an internal bounce
+ * buffer, copied over by commit() in one go (PSRAM then gets whole cache lines).
+ * The writer must hold the semaphore of the buffer from begin() to finish().
+ */
+class FrameWriter
+{
+public:
+  static const uint16_t CHUNK_SIZE = 2048;
+
+private:
+  byte bounceBuffer[CHUNK_SIZE];
+  SyncedMemoryBuffer* buffer = NULL;
+  uint32_t frameSize = 0;
+  uint32_t written = 0;
+  uint32_t fingerprint = 0;
+  FrameProfile profile;
+
+public:
+  void begin(SyncedMemoryBuffer* target, uint32_t size, uint32_t timestamp)
+  {
+    buffer = target;
+    frameSize = _min(size, buffer->maxSize());
+    written = 0;
+    fingerprint = 0;
+    profile.reset();
+    buffer->beginGrowing(frameSize, timestamp);
+  }
+
+  bool isDone()
+  {
+    return written >= frameSize;
+  }
+
+  uint32_t size()
+  {
+    return frameSize;
+  }
+
+  /**
+   * Bytes of the next chunk; read them into chunk().
+   */
+  uint16_t chunkSize()
+  {
+    return _min(CHUNK_SIZE, frameSize - written);
+  }
+
+  byte* chunk()
+  {
+    return buffer->isExternal() ? bounceBuffer : &(buffer->content())[written];
+  }
+
+  /**
+   * The chunk (of chunkSize()) was read.
+   */
+  void commit()
+  {
+    uint16_t length = chunkSize();
+    byte* data = chunk();
+    // while it is in the cache anyway
+    fingerprint = SyncedMemoryBuffer::hashContent(fingerprint, data, length);
+    profile.scan(data, length);
+    if (data == bounceBuffer) {
+      memcpy(&(buffer->content())[written], bounceBuffer, length);
+    }
+    written += length;
+
+    buffer->grow(written);
+  }
+
+  /**
+   * Publishes the frame (releases the buffer); set its trace before.
+   */
+  void finish(uint32_t timestamp)
+  {
+    buffer->setFingerprint(fingerprint);
+    profile.finish();
+    buffer->setProfile(profile);
+    buffer->release(frameSize, timestamp);
+  }
+};
+
+#endif
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __HEAP_MONITOR_H__
+#define __HEAP_MONITOR_H__
+
+#include <esp_heap_caps.h>
+
+/**
+ * Free heap is not enough to judge: WiFi and lwIP need contiguous blocks (ie 1.6k for a packet buffer).
+ * All values are about internal RAM (what WiFi and lwIP use); PSRAM is only reported as its free size.
+ */
+class HeapMonitor
+{
+public:
+  static const uint32_t LOW_FREE = 6000;
+  static const uint32_t LOW_LARGEST_BLOCK = 4000;
+  static const uint32_t INTERNAL = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+
+  static uint32_t freeHeap()
+  {
+    return heap_caps_get_free_size(INTERNAL);
+  }
+
+  static uint32_t largestFreeBlock()
+  {
+    return heap_caps_get_largest_free_block(INTERNAL);
+  }
+
+  /**
+   * The lowest free heap since start (kept by the allocator).
+   */
+  static uint32_t minimumFreeHeap()
+  {
+    return heap_caps_get_minimum_free_size(INTERNAL);
+  }
+
+  /**
+   * Percent of the free heap that is not in the largest block.
+   */
+  static uint8_t fragmentation()
+  {
+    uint32_t free = freeHeap();
+    return free == 0 ? 0 : 100 - (uint64_t)largestFreeBlock() * 100 / free;
+  }
+
+  static uint32_t freeExternal()
+  {
+    return heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+  }
+
+  static bool isTight()
+  {
+    return freeHeap() < LOW_FREE || largestFreeBlock() < LOW_LARGEST_BLOCK;
+  }
+
+  static String toString()
+  {
+    return "free "+String(freeHeap())+" largest "+String(largestFreeBlock())+" ("+String(fragmentation())+"%) min "+String(minimumFreeHeap());
+  }
+};
+
+#endif
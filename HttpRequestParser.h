@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __HTTP_REQUEST_PARSER_H__
+#define __HTTP_REQUEST_PARSER_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+/**
+ * Parses a http request byte by byte into fixed buffers (no heap use).
+ * Request line and headers; a body is not supported.
+ */
+class HttpRequestParser
+{
+public:
+  enum Result { NEED_MORE, COMPLETE, FAILED };
+
+private:
+  static const uint8_t MAX_METHOD = 8;
+  static const uint8_t MAX_TARGET = 128;
+  static const uint8_t MAX_HEADER_LINE = 128;
+  static const uint8_t MAX_ETAG = 24;
+  static const uint8_t MAX_WEB_SOCKET_KEY = 32;
+
+  enum State { REQUEST_LINE, HEADER_LINE, DONE, ERROR };
+
+  State state = REQUEST_LINE;
+  char line[MAX_HEADER_LINE];
+  uint8_t lineLength = 0;
+  bool lineTooLong = false;
+  
+  char requestMethod[MAX_METHOD];
+  char requestTarget[MAX_TARGET];
+  bool connectionClose = false;
+  char requestIfNoneMatch[MAX_ETAG];
+  char requestWebSocketKey[MAX_WEB_SOCKET_KEY];
+  bool upgradeWebSocket = false;
+
+public:
+  HttpRequestParser()
+  {
+    reset();
+  }
+
+  void reset()
+  {
+    state = REQUEST_LINE;
+    lineLength = 0;
+    lineTooLong = false;
+    requestMethod[0] = 0;
+    requestTarget[0] = 0;
+    connectionClose = false;
+    requestIfNoneMatch[0] = 0;
+    requestWebSocketKey[0] = 0;
+    upgradeWebSocket = false;
+  }
+
+  Result feed(char c)
+  {
+    if (state == DONE) {
+      return COMPLETE;
+    } else if (state == ERROR) {
+      return FAILED;
+    }
+
+    if (c == '\r') {
+      return NEED_MORE;
+    } else if (c != '\n') {
+      if (lineLength < sizeof(line) - 1) {
+        line[lineLength++] = c;
+      } else {
+        lineTooLong = true;
+      }
+      return NEED_MORE;
+    }
+
+    line[lineLength] = 0;
+    
+    if (state == REQUEST_LINE) {
+      if (lineLength == 0) {
+        // tolerate empty lines before a request
+      } else if (lineTooLong || !parseRequestLine()) {
+        state = ERROR;
+      } else {
+        state = HEADER_LINE;
+      }
+    } else if (lineLength == 0) {
+      state = DONE;
+    } else if (!lineTooLong) {
+      // overlong headers are ignored
+      parseHeaderLine();
+    }
+
+    lineLength = 0;
+    lineTooLong = false;
+
+    return state == DONE ? COMPLETE : (state == ERROR ? FAILED : NEED_MORE);
+  }
+
+  /**
+   * Feeds until a request is complete (or failed); the rest is not consumed.
+   */
+  Result feed(const char* data, uint32_t length, uint32_t* consumed)
+  {
+    Result result = state == DONE ? COMPLETE : (state == ERROR ? FAILED : NEED_MORE);
+    uint32_t i = 0;
+    while (i < length && result == NEED_MORE) {
+      result = feed(data[i++]);
+    }
+    *consumed = i;
+    return result;
+  }
+
+  const char* method()
+  {
+    return requestMethod;
+  }
+
+  /**
+   * The path as sent; may contain spaces.
+   */
+  const char* target()
+  {
+    return requestTarget;
+  }
+
+  /**
+   * Value of the "If-None-Match" header (as sent: with quotes); empty if none.
+   */
+  const char* ifNoneMatch()
+  {
+    return requestIfNoneMatch;
+  }
+
+  /**
+   * "Sec-WebSocket-Key" of an "Upgrade: websocket" request; empty otherwise.
+   */
+  const char* webSocketKey()
+  {
+    return upgradeWebSocket ? requestWebSocketKey : "";
+  }
+
+  /**
+   * Open unless the client asks for "Connection: close"; also for HTTP/1.0: the server never closed
+   * after an answer before and the browser and Android clients rely on that.
+   */
+  bool keepAlive()
+  {
+    return !connectionClose;
+  }
+
+private:
+  bool parseRequestLine()
+  {
+    // METHOD SP TARGET SP VERSION; the target may contain spaces (control commands)
+    char* firstSpace = strchr(line, ' ');
+    char* lastSpace = strrchr(line, ' ');
+    if (firstSpace == NULL || lastSpace == firstSpace) {
+      return false;
+    }
+
+    uint8_t methodLength = firstSpace - line;
+    uint8_t targetLength = lastSpace - firstSpace - 1;
+    if (methodLength == 0 || methodLength >= MAX_METHOD || targetLength == 0 || targetLength >= MAX_TARGET) {
+      return false;
+    }
+
+    const char* version = lastSpace + 1;
+    if (strncmp(version, "HTTP/1.", 7) != 0) {
+      return false;
+    }
+
+    memcpy(requestMethod, line, methodLength);
+    requestMethod[methodLength] = 0;
+    memcpy(requestTarget, firstSpace + 1, targetLength);
+    requestTarget[targetLength] = 0;
+
+    return true;
+  }
+
+  void parseHeaderLine()
+  {
+    char* colon = strchr(line, ':');
+    if (colon == NULL) {
+      return;
+    }
+
+    const char* value = colon + 1;
+    while (*value == ' ' || *value == '\t') {
+      value++;
+    }
+
+    uint8_t nameLength = colon - line;
+    if (nameLength == 10 && strncasecmp(line, "Connection", 10) == 0) {
+      connectionClose = strcasecmp(value, "close") == 0;
+    } else if (nameLength == 13 && strncasecmp(line, "If-None-Match", 13) == 0) {
+      strncpy(requestIfNoneMatch, value, MAX_ETAG - 1);
+      requestIfNoneMatch[MAX_ETAG - 1] = 0;
+    } else if (nameLength == 7 && strncasecmp(line, "Upgrade", 7) == 0) {
+      upgradeWebSocket = strcasecmp(value, "websocket") == 0;
+    } else if (nameLength == 17 && strncasecmp(line, "Sec-WebSocket-Key", 17) == 0) {
+      strncpy(requestWebSocketKey, value, MAX_WEB_SOCKET_KEY - 1);
+      requestWebSocketKey[MAX_WEB_SOCKET_KEY - 1] = 0;
+    }
+  }
+};
+
+#endif
@@ -18,30 +18,101 @@
 #define __IMAGE_SERVER_H__
  
 #include <WiFiServer.h>
+#include <lwip/sockets.h>
+#include <mbedtls/sha1.h>
+#include <mbedtls/base64.h>
 #include "SyncedMemoryBuffer.h"
 #include "ContinuousControl.h"
+#include "HttpRequestParser.h"
 
 bool SERVE_MULTI_IMAGES = false;
 
+/**
+ * Serves images to several http clients. Every client has its own send position in the
+ * (shared) frame buffer and only gets what its socket accepts without blocking.
+ * A client that finished a frame continues with the newest one; frames in between are skipped.
+ *
+ * Without SERVE_MULTI_IMAGES every frame has its own request: "/" gives the newest frame (or 304
+ * if it matches "If-None-Match"), "/next?after=<etag>&timeout=<millis>" waits for a newer frame.
+ * The ETag of a frame is its timestamp.
+ *
+ * "/ws" opens a WebSocket: frames are pushed as binary messages (newest only, like the stream)
+ * and text messages are control commands; their answers come back as text messages.
+ * Client messages must be masked and unfragmented, otherwise the socket closes with 1002.
+ */
 class ImageServer : public WiFiServer
 {
 private:
-  WiFiClient client;
-  bool waitForRequest = false;
-  bool waitForFirstRequest = true;
-  bool transferActive = false;
-  uint32_t waitForRequestStartTime = 0;
-  String currentLine = "";
-  uint32_t clientConnectTime;
-  bool clientNowConnected = false;
-  uint32_t lastTransferredTimestamp = 0;
-  bool wifiClientPresent = false;
-  uint32_t transferredImageCounter = 0;
+  static const uint8_t MAX_CLIENTS = 3;
+  const uint32_t STALLED_CLIENT_MILLIS = 3000;
+  const uint32_t DEFAULT_POLL_MILLIS = 2000;
+  const uint32_t MAX_POLL_MILLIS = 10000;
+  static const uint8_t MAX_PENDING_REPLIES = 4;
+
+  struct WebSocketReply
+  {
+    uint8_t opcode = 0;
+    uint8_t size = 0;
+    char payload[64];
+  };
+
+  struct ClientSlot
+  {
+    WiFiClient client;
+    bool active = false;
+    bool waitForRequest = false;
+    bool waitForFirstRequest = true;
+    bool transferActive = false;
+    uint32_t waitForRequestStartTime = 0;
+    HttpRequestParser parser;
+    bool keepAlive = true;
+    uint32_t clientConnectTime = 0;
+    uint32_t minimumTimestamp = 0; // only send frames newer than this
+    uint32_t pollDeadline = 0; // when waiting for a newer frame
+
+    bool webSocket = false;
+    uint8_t messageHeader[14];
+    uint8_t messageHeaderSize = 0;
+    uint8_t messagePayload[126]; // only small messages are read (commands)
+    uint32_t messagePayloadSize = 0;
+    uint32_t messagePayloadRead = 0;
+    WebSocketReply pendingReplies[MAX_PENDING_REPLIES]; // sent between frames
+    uint8_t firstPendingReply = 0;
+    uint8_t pendingReplyCount = 0;
+
+    // the frame currently sent
+    SyncedMemoryBuffer* frame = NULL;
+    char frameHeader[128];
+    uint16_t frameHeaderSize = 0;
+    uint8_t frameTrailerSize = 0;
+    uint32_t frameSize = 0;
+    uint32_t frameTimestamp = 0;
+    uint32_t currentlyTransferred = 0; // header, image data and trailing line
+    uint32_t frameStartTime = 0;
+    uint32_t lastProgressTime = 0;
+    uint32_t lastTransferredTimestamp = 0;
+
+    uint32_t transferredImageCounter = 0;
+    uint32_t skippedImageCounter = 0;
+    uint32_t transferredThisSecond = 0;
+    uint32_t lastTransferOutMillis = 0;
+  };
+
+  typedef void (ImageServer::*RequestHandler)(ClientSlot* slot, const char* target);
+
+  struct Route
+  {
+    const char* prefix;
+    bool exact;
+    RequestHandler handler;
+  };
+
+  ClientSlot slots[MAX_CLIENTS];
+  uint8_t connectedClients = 0;
+  uint32_t droppedReplies = 0;
+  uint32_t newestTimestamp = 0;
 
   ContinuousControl *control = NULL;
-  
-  uint32_t transferredThisSecond = 0;
-  uint32_t lastTransferOutMillis = 0;
 
 public:
   ImageServer(int port, ContinuousControl *cont) : WiFiServer(port)
@@ -50,201 +121,678 @@ public:
     control = cont;
   }
 
-  void drive(SyncedMemoryBuffer* imageData)
+  void drive(SyncedMemoryBuffer* imageDataOne, SyncedMemoryBuffer* imageDataOther)
   {
-    if (!client.connected()) {
-      if (clientNowConnected) {
-        Serial.println("Disconnect");
-        clientNowConnected = false;
+    acceptClient();
+
+    newestTimestamp = _max(imageDataOne->hasContent() ? imageDataOne->timestamp() : 0, imageDataOther->hasContent() ? imageDataOther->timestamp() : 0);
+
+    for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+      ClientSlot* slot = &slots[i];
+      if (!slot->active) {
+        continue;
       }
-      
-      client = accept();
-  
-      if (client.connected()) {
-        Serial.println("Client connect");
 
-        client.setNoDelay(true); // This speeds up response considerably (for smaller requests) 
-        
-        uint32_t now = millis();
-        clientNowConnected = true;
-        clientConnectTime = now;
-        waitForRequest = true;
-        waitForRequestStartTime = now;
-        transferActive = false;
-        currentLine = "";
+      if (!slot->client.connected()) {
+        disconnect(slot);
+        continue;
       }
-    }
-  
-    if (client.connected()) {
-      if (waitForRequest) {
-        uint32_t now = millis();
-        if (waitForRequestStartTime == 0) {
-          waitForRequestStartTime = now;
-        } else if (now - waitForRequestStartTime > 5000) {
-          Serial.println("Waiting for request...");
-          waitForRequestStartTime = 0;
+
+      if (slot->waitForRequest) {
+        handleRequest(slot);
+      } else if (slot->webSocket) {
+        readWebSocket(slot);
+
+        while (slot->active && slot->frame == NULL && slot->pendingReplyCount > 0) {
+          WebSocketReply* reply = &slot->pendingReplies[slot->firstPendingReply];
+          sendWebSocketMessage(slot, reply->opcode, (const uint8_t*)reply->payload, reply->size);
+          slot->firstPendingReply = (slot->firstPendingReply + 1) % MAX_PENDING_REPLIES;
+          slot->pendingReplyCount--;
         }
-        String requested = parseRequest();
-  
-        if (requested.length() > 0) {
-          waitForFirstRequest = false;
-  
-          //Serial.println("Requested "+requested);
-          
-          if (requested.startsWith("/ ")) {
-            String responseHeader = "HTTP/1.1 200 OK\n";
-            if (SERVE_MULTI_IMAGES) {
-              responseHeader += "Content-Type: multipart/x-mixed-replace; boundary=frame\n";
-              responseHeader += "\n";
-            }
-            client.print(responseHeader);
-  
-            waitForRequest = false;
-            transferActive = true;
-          } else if (requested.startsWith("/image_s")) {
-            client.println(getState());
-          } else if (control->supports(requested.substring(1))) {
-            String returnValue = control->handle(requested.substring(1));
-
-            if (returnValue.length() > 0) {
-              client.println(returnValue);
-              //Serial.println("Showing "+returnValue);
-            } else {
-              client.println("HUH?");
-            }
-          } else {
-            Serial.println("Ignoring request "+requested);
-            
-            client.println("HTTP/1.1 404 Not Found");
-            client.println();
-            client.stop();
-          }
+      }
+
+      if (slot->active && slot->transferActive && slot->frame == NULL) {
+        startFrame(slot, imageDataOne, imageDataOther);
+
+        if (slot->frame == NULL && slot->pollDeadline != 0 && (int32_t)(millis() - slot->pollDeadline) >= 0) {
+          // nothing new
+          sendNotModified(slot);
+          finishResponse(slot);
         }
       }
+
+      if (slot->frame != NULL) {
+        continueFrame(slot);
+      }
+    }
+  }
+
+  String getState()
+  {
+    String state = String(connectedClients);
+    for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+      ClientSlot* slot = &slots[i];
+      if (slot->active) {
+        state += " " + String(slot->waitForRequest) + String(slot->transferActive) + "/" + String(slot->transferredImageCounter) + "-" + String(slot->skippedImageCounter);
+      }
+    }
+    return state;
+  }
   
-      if (transferActive && imageData->contentSize() > 0) {
-        bool imageValid = lastTransferredTimestamp == 0 || imageData->timestamp() != lastTransferredTimestamp;
-        imageValid = true;
+private:
+  void acceptClient()
+  {
+    WiFiClient newClient = accept();
+    if (!newClient.connected()) {
+      return;
+    }
+
+    ClientSlot* slot = NULL;
+    for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+      if (!slots[i].active) {
+        slot = &slots[i];
+        break;
+      }
+    }
+
+    if (slot == NULL) {
+      Serial.println("Too many clients");
+      newClient.println("HTTP/1.1 503 Service Unavailable");
+      newClient.println();
+      newClient.stop();
+      return;
+    }
+
+    Serial.println("Client connect");
+
+    newClient.setNoDelay(true); // This speeds up response considerably (for smaller requests) 
+    
+    uint32_t now = millis();
+    slot->client = newClient;
+    slot->active = true;
+    slot->clientConnectTime = now;
+    slot->waitForRequest = true;
+    slot->waitForFirstRequest = true;
+    slot->waitForRequestStartTime = now;
+    slot->transferActive = false;
+    slot->parser.reset();
+    slot->frame = NULL;
+    slot->lastTransferredTimestamp = 0;
+    slot->minimumTimestamp = 0;
+    slot->pollDeadline = 0;
+    slot->webSocket = false;
+    slot->messageHeaderSize = 0;
+    slot->pendingReplyCount = 0;
+    slot->transferredImageCounter = 0;
+    slot->skippedImageCounter = 0;
+    slot->transferredThisSecond = 0;
+    slot->lastTransferOutMillis = now;
+    connectedClients++;
+  }
+
+  void disconnect(ClientSlot* slot)
+  {
+    Serial.println("Disconnect");
+
+    endFrame(slot);
+    slot->client.stop();
+    slot->active = false;
+    slot->transferActive = false;
+    slot->waitForRequest = false;
+    connectedClients--;
+  }
+
+  void handleRequest(ClientSlot* slot)
+  {
+    uint32_t now = millis();
+    if (slot->waitForRequestStartTime == 0) {
+      slot->waitForRequestStartTime = now;
+    } else if (now - slot->waitForRequestStartTime > 5000) {
+      Serial.println("Waiting for request...");
+      slot->waitForRequestStartTime = 0;
+    }
+
+    HttpRequestParser::Result result = parseRequest(slot);
+
+    if (!slot->active || result == HttpRequestParser::NEED_MORE) {
+      return;
+    }
+
+    if (result == HttpRequestParser::FAILED) {
+      Serial.println("Illegal request");
+
+      slot->client.println("HTTP/1.1 400 Bad Request");
+      slot->client.println();
+      disconnect(slot);
+      return;
+    }
+
+    slot->waitForFirstRequest = false;
+
+    //Serial.println("Requested "+String(slot->parser.target()));
+
+    slot->keepAlive = slot->parser.keepAlive();
+    if (strcmp(slot->parser.method(), "GET") == 0) {
+      dispatch(slot, slot->parser.target());
+    } else {
+      // like before the parser: only GET is served (control commands move the motors)
+      Serial.println("Rejecting "+String(slot->parser.method()));
+
+      slot->client.println("HTTP/1.1 405 Method Not Allowed");
+      slot->client.println("Allow: GET");
+      slot->client.println("Content-Length: 0");
+      slot->client.println();
+    }
+
+    if (slot->active && slot->waitForRequest && !slot->keepAlive) {
+      disconnect(slot);
+      return;
+    }
+
+    slot->parser.reset();
+  }
+
+  void dispatch(ClientSlot* slot, const char* target)
+  {
+    static const Route routes[] = {
+      { "/", true, &ImageServer::handleImageRequest },
+      { "/next", false, &ImageServer::handleNextFrameRequest },
+      { "/ws", true, &ImageServer::handleWebSocketRequest },
+      { "/image_s", false, &ImageServer::handleStateRequest },
+    };
+
+    for (uint8_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+      const Route* route = &routes[i];
+      bool matches = route->exact
+        ? strcmp(target, route->prefix) == 0
+        : strncmp(target, route->prefix, strlen(route->prefix)) == 0;
+
+      if (matches) {
+        (this->*(route->handler))(slot, target);
+        return;
+      }
+    }
+
+    handleControlRequest(slot, target);
+  }
+
+  void handleImageRequest(ClientSlot* slot, const char* target)
+  {
+    if (SERVE_MULTI_IMAGES) {
+      String responseHeader = "HTTP/1.1 200 OK\n";
+      responseHeader += "Content-Type: multipart/x-mixed-replace; boundary=frame\n";
+      responseHeader += "\n";
+      slot->client.print(responseHeader);
+    } else {
+      // the status line comes with the frame
+
+      const char* ifNoneMatch = slot->parser.ifNoneMatch();
+      if (ifNoneMatch[0] != 0 && newestTimestamp != 0 && parseTag(ifNoneMatch) == newestTimestamp) {
+        sendNotModified(slot);
+        return;
+      }
+
+      slot->minimumTimestamp = 0;
+    }
+
+    slot->pollDeadline = 0;
+    slot->waitForRequest = false;
+    slot->transferActive = true;
+  }
+
+  void handleNextFrameRequest(ClientSlot* slot, const char* target)
+  {
+    uint32_t after = queryValue(target, "after", 0);
+    if (after == 0) {
+      after = parseTag(slot->parser.ifNoneMatch());
+    }
+    uint32_t timeout = _min(MAX_POLL_MILLIS, queryValue(target, "timeout", DEFAULT_POLL_MILLIS));
+
+    slot->minimumTimestamp = after;
+    slot->pollDeadline = millis() + timeout;
+    if (slot->pollDeadline == 0) {
+      slot->pollDeadline = 1;
+    }
+    slot->waitForRequest = false;
+    slot->transferActive = true;
+  }
+
+  void handleWebSocketRequest(ClientSlot* slot, const char* target)
+  {
+    const char* key = slot->parser.webSocketKey();
+    if (key[0] == 0) {
+      slot->client.println("HTTP/1.1 400 Bad Request");
+      slot->client.println();
+      disconnect(slot);
+      return;
+    }
+
+    char keyAndGuid[72];
+    snprintf(keyAndGuid, sizeof(keyAndGuid), "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", key);
+    unsigned char hash[20];
+    mbedtls_sha1_ret((const unsigned char*)keyAndGuid, strlen(keyAndGuid), hash);
+    unsigned char accept[32];
+    size_t acceptSize = 0;
+    mbedtls_base64_encode(accept, sizeof(accept), &acceptSize, hash, sizeof(hash));
+    accept[acceptSize] = 0;
+
+    char response[160];
+    snprintf(response, sizeof(response), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+    slot->client.print(response);
+
+    Serial.println("WebSocket open");
+
+    slot->webSocket = true;
+    slot->keepAlive = true;
+    slot->messageHeaderSize = 0;
+    slot->pendingReplyCount = 0;
+    slot->waitForRequest = false;
+    slot->transferActive = true;
+  }
+
+  void handleStateRequest(ClientSlot* slot, const char* target)
+  {
+    slot->client.println(getState());
+  }
+
+  void handleControlRequest(ClientSlot* slot, const char* target)
+  {
+    String requested = String(&target[1]);
+
+    if (target[0] == '/' && control->supports(requested)) {
+      String returnValue = control->handle(requested);
+
+      if (returnValue.length() > 0) {
+        slot->client.println(returnValue);
+        //Serial.println("Showing "+returnValue);
+      } else {
+        slot->client.println("HUH?");
+      }
+    } else {
+      Serial.println("Ignoring request "+String(target));
+      
+      slot->client.println("HTTP/1.1 404 Not Found");
+      slot->client.println();
+      disconnect(slot);
+    }
+  }
 
-        if (!imageValid) {
-          Serial.print("-");
-          client.println("NOIY");
+  void startFrame(ClientSlot* slot, SyncedMemoryBuffer* imageDataOne, SyncedMemoryBuffer* imageDataOther)
+  {
+    bool oneIsNewer = imageDataOne->hasContent() && imageDataOne->timestamp() >= imageDataOther->timestamp();
+    SyncedMemoryBuffer* imageData = oneIsNewer ? imageDataOne : imageDataOther;
+    SyncedMemoryBuffer* older = oneIsNewer ? imageDataOther : imageDataOne;
+
+    // Only one buffer is pinned at a time (the camera can always write the other one); so while
+    // another client still sends the older frame, that one is sent (or waited for a newer one)
+    if (older->isPinned() && !imageData->isPinned()) {
+      imageData = older;
+      older = NULL;
+    }
+
+    // a stream only continues with newer frames; a single request gets any frame unless it asked for a newer one
+    uint32_t minimumTimestamp = SERVE_MULTI_IMAGES || slot->webSocket ? slot->lastTransferredTimestamp : slot->minimumTimestamp;
+    if (!imageData->hasContent() || (minimumTimestamp != 0 && imageData->timestamp() <= minimumTimestamp)) {
+      return;
+    }
 
-          // TODO centralize/refactor - see below
-          transferActive = false;
-          waitForRequest = true;
-          waitForRequestStartTime = millis();
+    // The camera does not write into a pinned buffer
+    if (!imageData->take("http", 0)) {
+      return;
+    }
+    imageData->pin();
+    imageData->release();
 
+    if (slot->lastTransferredTimestamp != 0 && older != NULL) {
+      if (older->hasContent() && older->timestamp() > slot->lastTransferredTimestamp) {
+        slot->skippedImageCounter++;
+      }
+    }
+
+    slot->frame = imageData;
+    slot->frameSize = imageData->contentSize();
+    slot->frameTimestamp = imageData->timestamp();
+    slot->frameTrailerSize = 2;
+    if (slot->webSocket) {
+      slot->frameHeaderSize = webSocketHeader((uint8_t*)slot->frameHeader, WS_BINARY, slot->frameSize);
+      slot->frameTrailerSize = 0;
+    } else if (SERVE_MULTI_IMAGES) {
+      slot->frameHeaderSize = snprintf(slot->frameHeader, sizeof(slot->frameHeader), "--frame\nContent-Type: image/jpeg\nContent-Length: %u\n\n",
+        slot->frameSize);
+    } else {
+      slot->frameHeaderSize = snprintf(slot->frameHeader, sizeof(slot->frameHeader), "HTTP/1.1 200 OK\nContent-Type: image/jpeg\nContent-Length: %u\nETag: \"%u\"\n\n",
+        slot->frameSize, slot->frameTimestamp);
+    }
+    slot->currentlyTransferred = 0;
+    slot->frameStartTime = millis();
+    slot->lastProgressTime = slot->frameStartTime;
+  }
+
+  void continueFrame(ClientSlot* slot)
+  {
+    static const char* FRAME_TRAILER = "\r\n";
+    uint32_t dataEnd = slot->frameHeaderSize + slot->frameSize;
+    uint32_t frameEnd = dataEnd + slot->frameTrailerSize;
+    int socket = slot->client.fd();
+
+    while (slot->currentlyTransferred < frameEnd) {
+      const byte* source;
+      uint32_t available;
+      if (slot->currentlyTransferred < slot->frameHeaderSize) {
+        source = (const byte*)&slot->frameHeader[slot->currentlyTransferred];
+        available = slot->frameHeaderSize - slot->currentlyTransferred;
+      } else if (slot->currentlyTransferred < dataEnd) {
+        // straight from the frame buffer
+        uint32_t dataPosition = slot->currentlyTransferred - slot->frameHeaderSize;
+        source = &((slot->frame->content())[dataPosition]);
+        available = slot->frameSize - dataPosition;
+      } else {
+        source = (const byte*)&FRAME_TRAILER[slot->currentlyTransferred - dataEnd];
+        available = frameEnd - slot->currentlyTransferred;
+      }
+
+      int transferredNow = send(socket, source, available, MSG_DONTWAIT);
+      if (transferredNow <= 0) {
+        if (transferredNow < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+          Serial.println("Send error "+String(errno));
+          disconnect(slot);
           return;
         }
-        
-        String imageHeader = "";
-        if (SERVE_MULTI_IMAGES) {
-          imageHeader += "--frame\n";
-        }
-        imageHeader += "Content-Type: image/jpeg\n";
-        imageHeader += "Content-Length: ";
-        imageHeader += String(imageData->contentSize());
-        imageHeader += "\n\n";
-        client.print(imageHeader); // Print as one block - will also work ok with setNoDelay(true)
-  
-        uint32_t currentlyTransferred = 0;
-        uint32_t blockStart = millis();
-  
-        while(currentlyTransferred < imageData->contentSize()) {
-          byte* bufferPointer = &((imageData->content())[currentlyTransferred]);
-          uint32_t transferredNow = client.write(bufferPointer, imageData->contentSize() - currentlyTransferred);
-          transferredThisSecond += transferredNow;
-          currentlyTransferred += transferredNow;
+        break; // socket full: continue with the next drive()
+      }
+
+      slot->currentlyTransferred += transferredNow;
+      slot->transferredThisSecond += transferredNow;
+      slot->lastProgressTime = millis();
+    }
+
+    uint32_t now = millis();
+
+    if (slot->currentlyTransferred < frameEnd) {
+      if (now - slot->lastProgressTime > STALLED_CLIENT_MILLIS) {
+        Serial.println("Client stalled");
+        disconnect(slot);
+      }
+      return;
+    }
+
+    slot->transferredImageCounter++;
+    slot->lastTransferredTimestamp = slot->frameTimestamp;
+    endFrame(slot);
+
+    bool streaming = SERVE_MULTI_IMAGES || slot->webSocket;
+
+    if (streaming) {
+      if (now - slot->lastTransferOutMillis >= 1000) {
+        double transferKbps = (slot->transferredThisSecond / ((now - slot->lastTransferOutMillis) / 1000.0)) / 1024.0;
+        Serial.println(String(slot->transferredImageCounter)+" "+String(transferKbps)+" "+String(now - slot->frameStartTime)+" skip "+String(slot->skippedImageCounter));
+      
+        slot->transferredThisSecond = 0;
+        slot->lastTransferOutMillis = now;
+      }
+    } else {
+      double transferKbps = (slot->currentlyTransferred / ((now - slot->frameStartTime + 1) / 1000.0)) / 1024.0;
+
+      if (slot->transferredImageCounter % 3 == 0 || now - slot->frameStartTime > 500) {
+        Serial.println(String(now - slot->frameStartTime)+" "+String(transferKbps));
+      }
+    }
+    
+    if (SERVE_MULTI_IMAGES && now - slot->clientConnectTime > 120000L) {
+      Serial.println("Test stop");
+      disconnect(slot);
+      return;
+    }
+
+    if (!streaming) {
+      finishResponse(slot);
+    }
+  }
+
+  /**
+   * Back to waiting for the next request (if the client wants to).
+   */
+  void finishResponse(ClientSlot* slot)
+  {
+    if (!slot->keepAlive) {
+      disconnect(slot);
+      return;
+    }
+
+    slot->transferActive = false;
+    slot->pollDeadline = 0;
+    slot->waitForRequest = true;
+    slot->waitForRequestStartTime = millis();
+  }
+
+  static const uint8_t WS_TEXT = 0x1;
+  static const uint8_t WS_BINARY = 0x2;
+  static const uint8_t WS_CLOSE = 0x8;
+  static const uint8_t WS_PING = 0x9;
+  static const uint8_t WS_PONG = 0xa;
+  static const uint16_t WS_NORMAL_CLOSURE = 1000;
+  static const uint16_t WS_PROTOCOL_ERROR = 1002;
+
+  /**
+   * Header of an unfragmented, unmasked message; returns its size.
+   */
+  static uint8_t webSocketHeader(uint8_t* header, uint8_t opcode, uint32_t payloadSize)
+  {
+    header[0] = 0x80 | opcode;
+    if (payloadSize < 126) {
+      header[1] = payloadSize;
+      return 2;
+    } else if (payloadSize <= 0xffff) {
+      header[1] = 126;
+      header[2] = payloadSize >> 8;
+      header[3] = payloadSize;
+      return 4;
+    } else {
+      header[1] = 127;
+      memset(&header[2], 0, 4);
+      header[6] = payloadSize >> 24;
+      header[7] = payloadSize >> 16;
+      header[8] = payloadSize >> 8;
+      header[9] = payloadSize;
+      return 10;
+    }
+  }
+
+  void sendWebSocketMessage(ClientSlot* slot, uint8_t opcode, const uint8_t* payload, uint8_t payloadSize)
+  {
+    uint8_t message[2 + 125];
+    uint8_t headerSize = webSocketHeader(message, opcode, payloadSize);
+    if (payloadSize > 0) {
+      memcpy(&message[headerSize], payload, payloadSize);
+    }
+    slot->client.write(message, headerSize + payloadSize);
+  }
+
+  /**
+   * Queues a message to be sent after the current frame; when the queue is full it is dropped.
+   */
+  void queueWebSocketMessage(ClientSlot* slot, uint8_t opcode, const char* payload, uint8_t payloadSize)
+  {
+    if (slot->pendingReplyCount == MAX_PENDING_REPLIES) {
+      droppedReplies++;
+      Serial.println("Dropping WebSocket reply; "+String(droppedReplies)+" so far");
+      return;
+    }
+
+    WebSocketReply* reply = &slot->pendingReplies[(slot->firstPendingReply + slot->pendingReplyCount) % MAX_PENDING_REPLIES];
+    reply->size = _min(payloadSize, sizeof(reply->payload));
+    reply->opcode = opcode;
+    memcpy(reply->payload, payload, reply->size);
+    slot->pendingReplyCount++;
+  }
+
+  /**
+   * Sends a close message with the status code and ends the connection.
+   */
+  void closeWebSocket(ClientSlot* slot, uint16_t statusCode)
+  {
+    endFrame(slot); // a close message must not land inside a frame; the socket ends anyway
+    uint8_t payload[2] = { (uint8_t)(statusCode >> 8), (uint8_t)statusCode };
+    sendWebSocketMessage(slot, WS_CLOSE, payload, sizeof(payload));
+    disconnect(slot);
+  }
+
+  void readWebSocket(ClientSlot* slot)
+  {
+    uint64_t methodStartTime = esp_timer_get_time();
+
+    while (slot->client.available() > 0 && esp_timer_get_time() - methodStartTime < 2000) {
+      uint8_t c = slot->client.read();
+
+      if (slot->messageHeaderSize < 2 || slot->messageHeaderSize < webSocketInputHeaderSize(slot)) {
+        slot->messageHeader[slot->messageHeaderSize++] = c;
+
+        if (slot->messageHeaderSize == 2 && !isSupportedWebSocketFrame(slot)) {
+          Serial.println("WebSocket protocol error");
+          closeWebSocket(slot, WS_PROTOCOL_ERROR);
+          return;
         }
-        client.println();
-        //client.flush(); // This will eventually destroy an incoming request; the server is then dead (??)
 
-        transferredImageCounter++;
-        lastTransferredTimestamp = imageData->timestamp();
-        
-        uint32_t now = millis();
-  
-        if (SERVE_MULTI_IMAGES) {
-          if (now - lastTransferOutMillis >= 1000) {
-            double transferKbps = (transferredThisSecond / ((now - lastTransferOutMillis) / 1000.0)) / 1024.0;
-            Serial.println(String(transferredImageCounter)+" "+String(transferKbps)+" "+String(now - blockStart));
-          
-            transferredThisSecond = 0;
-            lastTransferOutMillis = now;
-          }
+        if (slot->messageHeaderSize >= 2 && slot->messageHeaderSize == webSocketInputHeaderSize(slot)) {
+          slot->messagePayloadSize = webSocketInputPayloadSize(slot);
+          slot->messagePayloadRead = 0;
         } else {
-          double transferKbps = (currentlyTransferred / ((now - blockStart) / 1000.0)) / 1024.0;
-          if (transferredImageCounter % 10 == 0 || transferKbps < 100) {
-            //Serial.println(String(transferredImageCounter)+" "+String(transferKbps)+" "+String(now - blockStart));
-          }
-
-          if (transferredImageCounter % 3 == 0 || now-blockStart > 500) {
-            Serial.println(String(now - blockStart)+" "+String(transferKbps));
-          }
+          continue;
         }
-        
-        if (SERVE_MULTI_IMAGES && now - clientConnectTime > 120000L) {
-          client.stop();
-          Serial.println("Test stop");
-          transferActive = false;
+      } else {
+        if (slot->messagePayloadRead < sizeof(slot->messagePayload)) {
+          uint8_t* mask = &slot->messageHeader[slot->messageHeaderSize - 4];
+          slot->messagePayload[slot->messagePayloadRead] = c ^ mask[slot->messagePayloadRead % 4];
         }
-  
-        if (!SERVE_MULTI_IMAGES) {
-          transferActive = false;
-          waitForRequest = true;
-          waitForRequestStartTime = now;
+        slot->messagePayloadRead++;
+      }
+
+      if (slot->messagePayloadRead == slot->messagePayloadSize) {
+        handleWebSocketMessage(slot);
+        slot->messageHeaderSize = 0;
+
+        if (!slot->active) {
+          return;
         }
       }
     }
   }
 
-  String getState()
+  /**
+   * Clients must mask their frames; fragmented messages (and extensions) are not supported.
+   */
+  bool isSupportedWebSocketFrame(ClientSlot* slot)
   {
-    return String(client.connected()) + " " + String(waitForRequest) + " " + String(transferActive);
+    bool isFinal = (slot->messageHeader[0] & 0x80) != 0;
+    bool hasReservedBits = (slot->messageHeader[0] & 0x70) != 0;
+    bool isContinuation = (slot->messageHeader[0] & 0x0f) == 0;
+    bool isMasked = (slot->messageHeader[1] & 0x80) != 0;
+    return isFinal && !hasReservedBits && !isContinuation && isMasked;
   }
-  
-private:
-  String parseRequest()
+
+  uint8_t webSocketInputHeaderSize(ClientSlot* slot)
   {
-    if (!waitForRequest)
-      return "";
+    uint8_t lengthCode = slot->messageHeader[1] & 0x7f;
+    uint8_t size = 2 + (lengthCode == 126 ? 2 : (lengthCode == 127 ? 8 : 0));
+    return size + ((slot->messageHeader[1] & 0x80) != 0 ? 4 : 0);
+  }
 
-    if (waitForFirstRequest && millis() - clientConnectTime > 2000) {
-      waitForRequest = false;
-      client.stop();
-      Serial.println("Waited too long for a client request. Current line content: "+currentLine);
+  uint32_t webSocketInputPayloadSize(ClientSlot* slot)
+  {
+    uint8_t lengthCode = slot->messageHeader[1] & 0x7f;
+    if (lengthCode == 126) {
+      return (slot->messageHeader[2] << 8) | slot->messageHeader[3];
+    } else if (lengthCode == 127) {
+      // NOTE bigger messages are not expected from clients
+      return (slot->messageHeader[6] << 24) | (slot->messageHeader[7] << 16) | (slot->messageHeader[8] << 8) | slot->messageHeader[9];
     }
-    
-    uint64_t methodStartTime = esp_timer_get_time();
+    return lengthCode;
+  }
 
-    while (client.available() > 0 && esp_timer_get_time() - methodStartTime < 2000) {
-      /* This does not read past the first line and results in a "broken connection" in Firefox
-      String oneRequestLine = client.readStringUntil('\n');
-      Serial.println(oneRequestLine);
-      if (currentLine.length() == 0) {
-        break;
-      }*/
+  void handleWebSocketMessage(ClientSlot* slot)
+  {
+    uint8_t opcode = slot->messageHeader[0] & 0x0f;
+    uint32_t payloadSize = _min(slot->messagePayloadSize, sizeof(slot->messagePayload) - 1);
+
+    if (opcode == WS_CLOSE) {
+      Serial.println("WebSocket close");
+      closeWebSocket(slot, WS_NORMAL_CLOSURE);
+    } else if (opcode == WS_PING) {
+      queueWebSocketMessage(slot, WS_PONG, (const char*)slot->messagePayload, payloadSize);
+    } else if (opcode == WS_TEXT || opcode == WS_BINARY) {
+      if (slot->messagePayloadSize > payloadSize) {
+        Serial.println("Ignoring long WebSocket message");
+        return;
+      }
       
-      char c = client.read();
-      if (c == '\n') {
-        if (currentLine.length() == 0) {
-          Serial.print("B");
-          break;
-        } else {
-          if (currentLine.startsWith("GET ")) {
-            String currentRequest = currentLine.substring(4);
-            currentLine = "";
-            return currentRequest;
-          }
-          currentLine = "";
-        }
-      } else if (c != '\r') {
-        currentLine += c;
+      slot->messagePayload[payloadSize] = 0;
+      String requested = String((char*)slot->messagePayload);
+
+      String returnValue = control->supports(requested) ? control->handle(requested) : "";
+      if (returnValue.length() == 0) {
+        returnValue = "HUH?";
+      }
+      queueWebSocketMessage(slot, WS_TEXT, returnValue.c_str(), returnValue.length());
+    }
+  }
+
+  void sendNotModified(ClientSlot* slot)
+  {
+    char response[64];
+    snprintf(response, sizeof(response), "HTTP/1.1 304 Not Modified\nETag: \"%u\"\n\n", newestTimestamp);
+    slot->client.print(response);
+  }
+
+  /**
+   * The number in an ETag like "12345" (or W/"12345"); 0 if none.
+   */
+  static uint32_t parseTag(const char* tag)
+  {
+    while (*tag != 0 && (*tag < '0' || *tag > '9')) {
+      tag++;
+    }
+    return strtoul(tag, NULL, 10);
+  }
+
+  static uint32_t queryValue(const char* target, const char* name, uint32_t defaultValue)
+  {
+    const char* query = strchr(target, '?');
+    size_t nameLength = strlen(name);
+    while (query != NULL) {
+      query++;
+      if (strncmp(query, name, nameLength) == 0 && query[nameLength] == '=') {
+        return strtoul(&query[nameLength + 1], NULL, 10);
       }
+      query = strchr(query, '&');
+    }
+
+    return defaultValue;
+  }
+
+  void endFrame(ClientSlot* slot)
+  {
+    if (slot->frame != NULL) {
+      slot->frame->unpin();
+      slot->frame = NULL;
+    }
+  }
+
+  HttpRequestParser::Result parseRequest(ClientSlot* slot)
+  {
+    if (slot->waitForFirstRequest && millis() - slot->clientConnectTime > 2000) {
+      Serial.println("Waited too long for a client request");
+      disconnect(slot);
+      return HttpRequestParser::NEED_MORE;
+    }
+    
+    uint64_t methodStartTime = esp_timer_get_time();
+
+    HttpRequestParser::Result result = HttpRequestParser::NEED_MORE;
+    while (result == HttpRequestParser::NEED_MORE && slot->client.available() > 0 && esp_timer_get_time() - methodStartTime < 2000) {
+      result = slot->parser.feed((char)slot->client.read());
     }
 
-    return "";
+    return result;
   }
 };
 
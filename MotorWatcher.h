@@ -17,23 +17,58 @@
 #ifndef __MOTOR_WATCHER_H__
 #define __MOTOR_WATCHER_H__
 
+#include "driver/pcnt.h"
+
+/**
+ * Counts the encoder edges of both wheels in the pulse counter (PCNT) peripheral and estimates
+ * the current rpm from the time between counter overflows (not from counts per time window).
+ *
+ * At low speed the counter interrupts on every edge, so the time between two edges is measured
+ * (no averaging delay when crawling). With edges faster than FAST_EDGE_MICROS it interrupts only every
+ * EDGES_PER_EVENT_FAST edges (an average over these; keeps the interrupt load low).
+ * The interrupt records a timestamp and switches between the two.
+ */
 class MotorWatcher
 {
-public:
-  static volatile uint32_t counterR;
-  static volatile uint32_t counterL;
-
 private:
+  // Written by the pcnt interrupt; read with a sequence number so no torn values are seen
+  struct EdgeSnapshot
+  {
+    pcnt_unit_t unit;
+    volatile uint32_t sequence = 0;
+    volatile uint32_t eventCount = 0;
+    volatile uint32_t lastEventMicros = 0;
+    volatile uint32_t lastPeriodMicros = 0;
+    volatile int16_t lastPeriodEdges = 1; // edges in lastPeriodMicros
+    volatile int16_t edgesPerEvent = 1; // currently
+  };
+
+  // alpha-beta filtered rpm of one wheel
+  struct WheelEstimate
+  {
+    uint32_t seenEventCount = 0;
+    float turns = 0;
+    float turnsChange = 0; // per second
+  };
+
   const uint8_t ENCODER_TICKS = 7; // per revolution; TODO this value is determined by observation (it doesn't corrspond to spec "12")
-  
-  uint32_t lastCheckTime = 0;
-  uint32_t lastCounterRight = 0;
-  uint32_t lastCounterLeft = 0;
-  uint16_t motorReduction = 1;
+  static const int16_t EDGES_PER_EVENT_FAST = 7; // NOTE the counter resets itself on reaching its limit
+  static const uint32_t FAST_EDGE_MICROS = 1500; // faster edges are averaged
+  static const uint32_t SLOW_EDGE_MICROS = 3000; // back to single edges (not directly at FAST_EDGE_MICROS: no toggling)
+  const float ALPHA = 0.5f;
+  const float BETA = 0.1f;
+  const uint32_t STANDING_MICROS = 2000000; // no edge for this long: wheel is standing
+
+  const pcnt_unit_t UNIT_RIGHT = PCNT_UNIT_0;
+  const pcnt_unit_t UNIT_LEFT = PCNT_UNIT_1;
 
-  // contains summed media data of old values
-  float lastTurnsRight = 0; 
-  float lastTurnsLeft = 0;
+  EdgeSnapshot edgesRight;
+  EdgeSnapshot edgesLeft;
+  WheelEstimate estimateRight;
+  WheelEstimate estimateLeft;
+
+  uint32_t lastCheckMicros = 0;
+  uint16_t motorReduction = 1;
 
 public:
   void setup(uint8_t interruptRight, uint8_t interruptLeft, uint16_t reduction)
@@ -41,51 +76,158 @@ public:
     motorReduction = reduction;
     
     pinMode(interruptRight, INPUT_PULLUP);
-    attachInterrupt(digitalPinToInterrupt(interruptRight), countR, FALLING);
     pinMode(interruptLeft, INPUT_PULLUP);
-    attachInterrupt(digitalPinToInterrupt(interruptLeft), countL, FALLING);
+
+    // NOTE not an IRAM interrupt: the handler may call the (flash) pcnt driver functions
+    pcnt_isr_service_install(0);
+    setupCounter(UNIT_RIGHT, interruptRight, &edgesRight);
+    setupCounter(UNIT_LEFT, interruptLeft, &edgesLeft);
   }
 
   void drive()
   {
-    uint32_t now = millis();
-    if (now - lastCheckTime >= 10) {
-      uint32_t ri = counterR;
-      uint32_t le = counterL;
-
-      float partOfSecond = (now - lastCheckTime) / 1000.0f;
-      float currentTurnsRight = 60 * (((ri - lastCounterRight) / (float)(ENCODER_TICKS * motorReduction)) / partOfSecond);
-      float currentTurnsLeft = 60 * (((le - lastCounterLeft) / (float)(ENCODER_TICKS * motorReduction)) / partOfSecond);
-
-      lastTurnsRight = (currentTurnsRight + lastTurnsRight) / 2.0f;
-      lastTurnsLeft = (currentTurnsLeft + lastTurnsLeft) / 2.0f;
-
-      lastCounterRight = ri;
-      lastCounterLeft = le;
-      
-      lastCheckTime = now;
+    uint32_t now = micros();
+    if (lastCheckMicros > 0) {
+      float partOfSecond = (now - lastCheckMicros) / 1000000.0f;
+
+      updateEstimate(&edgesRight, &estimateRight, now, partOfSecond);
+      updateEstimate(&edgesLeft, &estimateLeft, now, partOfSecond);
     }
+    
+    lastCheckMicros = now;
   }
 
   float currentTurnsRight()
   {
-    return lastTurnsRight;
+    return estimateRight.turns;
   }
 
-  uint16_t currentTurnsLeft()
+  float currentTurnsLeft()
   {
-    return lastTurnsLeft;
+    return estimateLeft.turns;
   }
 
 private:
-  static void countR()
+  void setupCounter(pcnt_unit_t unit, uint8_t pin, EdgeSnapshot* edges)
+  {
+    pcnt_config_t config;
+    config.pulse_gpio_num = pin;
+    config.ctrl_gpio_num = PCNT_PIN_NOT_USED;
+    config.lctrl_mode = PCNT_MODE_KEEP;
+    config.hctrl_mode = PCNT_MODE_KEEP;
+    config.pos_mode = PCNT_COUNT_DIS;
+    config.neg_mode = PCNT_COUNT_INC; // falling edges like the former interrupt
+    config.counter_h_lim = 1;
+    config.counter_l_lim = 0;
+    config.unit = unit;
+    config.channel = PCNT_CHANNEL_0;
+    pcnt_unit_config(&config);
+
+    // ignore glitches shorter than 100 APB cycles (1.25us)
+    pcnt_set_filter_value(unit, 100);
+    pcnt_filter_enable(unit);
+
+    edges->unit = unit;
+    pcnt_event_enable(unit, PCNT_EVT_H_LIM);
+    pcnt_isr_handler_add(unit, onEdges, edges);
+
+    pcnt_counter_pause(unit);
+    pcnt_counter_clear(unit);
+    pcnt_intr_enable(unit);
+    pcnt_counter_resume(unit);
+  }
+
+  void readSnapshot(EdgeSnapshot* edges, EdgeSnapshot* copy)
   {
-    counterR++;
+    uint32_t sequence;
+    do {
+      sequence = edges->sequence;
+      __sync_synchronize();
+      copy->eventCount = edges->eventCount;
+      copy->lastEventMicros = edges->lastEventMicros;
+      copy->lastPeriodMicros = edges->lastPeriodMicros;
+      copy->lastPeriodEdges = edges->lastPeriodEdges;
+      copy->edgesPerEvent = edges->edgesPerEvent;
+      __sync_synchronize();
+    } while ((sequence & 1) != 0 || sequence != edges->sequence);
   }
 
-  static void countL()
+  void updateEstimate(EdgeSnapshot* edges, WheelEstimate* estimate, uint32_t now, float partOfSecond)
   {
-    counterL++;
+    EdgeSnapshot snapshot;
+    readSnapshot(edges, &snapshot);
+
+    // predict
+    estimate->turns += estimate->turnsChange * partOfSecond;
+
+    float measuredTurns;
+    uint32_t sinceLastEvent = now - snapshot.lastEventMicros;
+    uint32_t expectedPeriod = snapshot.lastPeriodMicros / snapshot.lastPeriodEdges * snapshot.edgesPerEvent;
+    if (snapshot.eventCount != estimate->seenEventCount && snapshot.eventCount > 1) {
+      measuredTurns = turnsFromPeriod(snapshot.lastPeriodMicros, snapshot.lastPeriodEdges);
+    } else if (snapshot.eventCount == 0 || sinceLastEvent > STANDING_MICROS) {
+      measuredTurns = 0;
+    } else if (sinceLastEvent > expectedPeriod) {
+      // slowing down: the next event is late; the wheel can at most turn this fast
+      measuredTurns = _min(estimate->turns, turnsFromPeriod(sinceLastEvent, snapshot.edgesPerEvent));
+    } else {
+      // nothing new measured
+      return;
+    }
+
+    estimate->seenEventCount = snapshot.eventCount;
+
+    float residual = measuredTurns - estimate->turns;
+    estimate->turns += ALPHA * residual;
+    if (partOfSecond > 0) {
+      estimate->turnsChange += BETA * residual / partOfSecond;
+    }
+
+    if (estimate->turns < 0) {
+      estimate->turns = 0;
+      estimate->turnsChange = 0;
+    }
+  }
+
+  float turnsFromPeriod(uint32_t periodMicros, int16_t edgeCount)
+  {
+    if (periodMicros == 0) {
+      return 0;
+    }
+
+    return 60 * ((edgeCount / (float)(ENCODER_TICKS * motorReduction)) / (periodMicros / 1000000.0f));
+  }
+
+  static void IRAM_ATTR onEdges(void* arg)
+  {
+    EdgeSnapshot* edges = (EdgeSnapshot*)arg;
+    uint32_t now = micros();
+    uint32_t period = now - edges->lastEventMicros;
+    int16_t edgeCount = edges->edgesPerEvent;
+
+    edges->sequence++;
+    __sync_synchronize();
+    edges->lastPeriodMicros = period;
+    edges->lastPeriodEdges = edgeCount;
+    edges->lastEventMicros = now;
+    edges->eventCount++;
+    __sync_synchronize();
+    edges->sequence++;
+
+    uint32_t edgeMicros = period / edgeCount;
+    int16_t wanted = edgeCount;
+    if (edgeCount == 1 && edgeMicros < FAST_EDGE_MICROS) {
+      wanted = EDGES_PER_EVENT_FAST;
+    } else if (edgeCount > 1 && edgeMicros > SLOW_EDGE_MICROS) {
+      wanted = 1;
+    }
+
+    if (wanted != edgeCount) {
+      // the counter has just restarted at 0; clearing it only loses edges of the last few micros
+      pcnt_set_event_value(edges->unit, PCNT_EVT_H_LIM, wanted);
+      pcnt_counter_clear(edges->unit);
+      edges->edgesPerEvent = wanted;
+    }
   }
 };
 
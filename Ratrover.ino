@@ -23,10 +23,35 @@
 //#include "Motor.h"
 #include "StepperMotors.h"
 #include "SyncedMemoryBuffer.h"
+#include "VoltageSampler.h"
+#include "HeapMonitor.h"
+#include "ChannelSelector.h"
+#include "WifiLinkSettings.h"
+
+// frame buffers and task stacks at build time: the heap then only serves WiFi and lwIP
+// (on PSRAM boards the frame buffers are not static: they come from the heap only if the PSRAM fails)
+#define STATIC_ALLOCATION true
+// frame buffers in PSRAM on boards that have it (set by the board definition); allows the highest resolution
+#ifdef BOARD_HAS_PSRAM
+#define EXTERNAL_FRAME_STORAGE true
+#else
+#define EXTERNAL_FRAME_STORAGE false
+#endif
+// move the AP to a less congested channel when sending keeps failing (clients must reconnect then)
+#define CHANNEL_RESCAN false
 
 const int LED2 = 16;
-
-const int CHANNEL = 1;
+const int VOLTAGE_PIN = 34;
+
+const char* SSID = "Roversnail";
+const uint8_t DEFAULT_CHANNEL = 1;
+const uint8_t HIGHEST_CHANNEL = 11; // 12 and 13 are not allowed everywhere
+const uint32_t RESCAN_CHECK_MILLIS = 10000;
+const uint8_t RESCAN_ERROR_PERCENT = 10;
+const uint8_t RESCAN_BAD_CHECKS = 3; // in a row
+const uint32_t RESCAN_MIN_MILLIS = 300000;
+// rate adaptation stays on (a fixed rate loses the link at range); "link rate .." tries fixed rates at runtime
+const char* LINK_SETTINGS = "proto bgn bw 20 rate auto power 19.5";
 
 // first pin must be the one for "forward"
 const uint8_t MOTOR_R1 = 33;
@@ -53,13 +78,22 @@ const uint16_t MOTOR_RESOLUTION = 800; // steps per rotation; this assumes a sub
 //SyncedMemoryBuffer cameraBuffer;
 SyncedMemoryBuffer serverBufferOne;
 SyncedMemoryBuffer serverBufferOther;
-//volatile uint32_t MotorWatcher::counterR = 0;
-//volatile uint32_t MotorWatcher::counterL = 0;
 StepperMotors motor;
-ContinuousControl control(&motor);
+VoltageSampler voltageSampler;
+WifiLinkSettings linkSettings;
+ContinuousControl control(&motor, &voltageSampler, &linkSettings);
 //ImageServer imageServer(80, &control);
 UdpImageServer imageServer(1510, &control);
 AsyncArducam camera;
+#if STATIC_ALLOCATION && !EXTERNAL_FRAME_STORAGE
+byte frameStorageOne[BUFFER_SIZE];
+byte frameStorageOther[BUFFER_SIZE];
+#endif
+#if STATIC_ALLOCATION
+TaskMemory<4000> cameraTaskMemory;
+TaskMemory<5000> motorTaskMemory;
+TaskMemory<2000> voltageTaskMemory;
+#endif
 bool cameraValid = true;
 uint8_t lastWifiClientCount = 0;
 
@@ -67,6 +101,14 @@ uint32_t lastSuccessfulImageCopy = 0;
 bool llWarning = false;
 uint32_t lastShowAlive = 0;
 uint32_t lastShowLow = 0;
+uint32_t lastShowPeriods = 0;
+uint32_t lastPeriodMisses = 0;
+uint8_t wifiChannel = DEFAULT_CHANNEL;
+uint32_t lastRescanCheck = 0;
+uint32_t lastRescan = 0;
+uint32_t lastSentPackets = 0;
+uint32_t lastErrorPackets = 0;
+uint8_t badRescanChecks = 0;
 
 void setup() 
 {
@@ -81,31 +123,55 @@ void setup()
   // NOTE 50.000 bytes per buffer are too much for poor WiFi: no connections anymore
   // NOTE 40.000 bytes per buffer are too much for poor Udp: crashes on parsePacket()
   //cameraBuffer.setup();
-  serverBufferOne.setup();
-  serverBufferOther.setup();
+  bool externalFrames = EXTERNAL_FRAME_STORAGE
+    && SyncedMemoryBuffer::setupExternal(&serverBufferOne, &serverBufferOther, EXTERNAL_BUFFER_SIZE);
+  if (externalFrames) {
+    Serial.println("Frame buffers in PSRAM");
+  } else {
+#if STATIC_ALLOCATION && !EXTERNAL_FRAME_STORAGE
+    serverBufferOne.setup(frameStorageOne, sizeof(frameStorageOne));
+    serverBufferOther.setup(frameStorageOther, sizeof(frameStorageOther));
+#else
+    // before WiFi and lwIP allocate: a fresh heap does not fragment from this either
+    serverBufferOne.setup();
+    serverBufferOther.setup();
+#endif
+  }
 
   // NOTE this breaks voltage metering on pin 27 (=ADC2)...
   if (!setupWifi()) {
     while(1);
   }
   
-  if (!camera.setup(OV2640_800x600, &serverBufferOne, &serverBufferOther)) {  // OV2640_320x240, OV2640_1600x1200, 
+  if (!camera.setup(externalFrames ? OV2640_1600x1200 : OV2640_800x600, &serverBufferOne, &serverBufferOther)) {  // OV2640_320x240, OV2640_1600x1200, 
     cameraValid = false;
   }
 
   if (cameraValid) {
     outputPin(LED2);
     digitalWrite(LED2, HIGH);
+#if STATIC_ALLOCATION
+    camera.start("cam", 4, &cameraTaskMemory);
+#else
     camera.start("cam", 4, 4000);
+#endif
   }
   imageServer.begin();
 
+  voltageSampler.setup(VOLTAGE_PIN);
+
+#if STATIC_ALLOCATION
+  motor.start("motor", 5, &motorTaskMemory);
+  voltageSampler.start("voltage", 1, &voltageTaskMemory);
+#else
   motor.start("motor", 5);
+  voltageSampler.start("voltage", 1, 2000);
+#endif
 
   //motor.requestMovement(0.02, 0, 500);
   //motor.hold();
   
-  Serial.println("Waiting for connections... free "+String(ESP.getFreeHeap()));
+  Serial.println("Waiting for connections... "+HeapMonitor::toString());
 }
 
 void outputPin(int num)
@@ -117,16 +183,27 @@ void outputPin(int num)
 
 bool setupWifi()
 {
+  // scanning needs the station part
+  WiFi.mode(WIFI_STA);
+  WiFi.disconnect();
+  wifiChannel = scanForChannel(NULL);
+
   WiFi.mode(WIFI_AP);
   
-  bool b1 = WiFi.softAP("Roversnail", NULL, CHANNEL, 0, 2); // TODO scan continuum for proper channel?
+  bool b1 = WiFi.softAP(SSID, NULL, wifiChannel, 0, 2);
   delay(100);
   bool b2 = WiFi.softAPConfig(IPAddress(192,168,151,1), IPAddress(192,168,151,254), IPAddress(255,255,255,0));
 
 
   if (b1 && b2) {
-    Serial.print("WiFi AP started ");
+    Serial.print("WiFi AP started on channel "+String(wifiChannel)+" ");
     Serial.println(WiFi.softAPIP());
+
+    linkSettings.configure(LINK_SETTINGS);
+    if (!linkSettings.apply()) {
+      Serial.println("Link settings incomplete");
+    }
+    Serial.println("Link "+linkSettings.toString());
   } else {
     Serial.println("Could not start AP. config: "+String(b1)+" start:"+String(b2));
     return false;
@@ -135,18 +212,105 @@ bool setupWifi()
   return true;
 }
 
+/**
+ * @param selector filled with the scan results; may be NULL
+ * @return the least congested channel (DEFAULT_CHANNEL if the scan failed)
+ */
+uint8_t scanForChannel(ChannelSelector* selector)
+{
+  ChannelSelector ownSelector(HIGHEST_CHANNEL);
+  if (selector == NULL) {
+    selector = &ownSelector;
+  }
+
+  uint32_t scanStart = millis();
+  int16_t networkCount = WiFi.scanNetworks();
+  if (networkCount < 0) {
+    Serial.println("WiFi scan failed "+String(networkCount));
+    return DEFAULT_CHANNEL;
+  }
+
+  for (int16_t i = 0; i < networkCount; i++) {
+    // same format as the recordings of tools/channel_scan
+    Serial.println("W "+String(WiFi.channel(i))+" "+String(WiFi.RSSI(i))+" "+WiFi.SSID(i));
+    selector->addNetwork(WiFi.channel(i), WiFi.RSSI(i));
+  }
+  WiFi.scanDelete();
+
+  uint8_t channel = selector->bestChannel();
+  Serial.println("Scanned "+String(networkCount)+" networks in "+String(millis() - scanStart)+"ms; best channel "+String(channel)+" score "+String(selector->score(channel)));
+
+  return channel;
+}
+
+/**
+ * A high rate of failed sends over some time hints at a crowded channel.
+ */
+void rescanIfErroneous(uint32_t now)
+{
+  if (now - lastRescanCheck < RESCAN_CHECK_MILLIS) {
+    return;
+  }
+  lastRescanCheck = now;
+
+  uint32_t sentPackets = imageServer.getSentPackets();
+  uint32_t errorPackets = imageServer.getErrorPackets();
+  uint32_t sentDiff = sentPackets - lastSentPackets;
+  uint32_t errorDiff = errorPackets - lastErrorPackets;
+  lastSentPackets = sentPackets;
+  lastErrorPackets = errorPackets;
+
+  // failed image packets are also counted as sent
+  if (sentDiff == 0 || errorDiff * 100 < sentDiff * RESCAN_ERROR_PERCENT) {
+    badRescanChecks = 0;
+    return;
+  }
+
+  if (++badRescanChecks < RESCAN_BAD_CHECKS || (lastRescan != 0 && now - lastRescan < RESCAN_MIN_MILLIS)) {
+    return;
+  }
+  badRescanChecks = 0;
+  lastRescan = now;
+
+  Serial.println("Many send errors ("+String(errorDiff)+" of "+String(sentDiff)+"); rescanning");
+
+  // the AP stays up (but is deaf during the scan)
+  WiFi.mode(WIFI_AP_STA);
+  ChannelSelector selector(HIGHEST_CHANNEL);
+  scanForChannel(&selector);
+  WiFi.mode(WIFI_AP);
+
+  if (selector.isWorthSwitching(wifiChannel)) {
+    wifiChannel = selector.bestChannel();
+    Serial.println("Moving AP to channel "+String(wifiChannel));
+    WiFi.softAP(SSID, NULL, wifiChannel, 0, 2);
+    linkSettings.apply();
+  }
+
+  lastRescanCheck = millis();
+}
+
 bool showDebug = false;
 
 void loop()
 {
   uint32_t now = millis();
   
-  uint32_t freex = ESP.getFreeHeap();
-  if (freex < 6000 && now - lastShowLow > 500) {
-    Serial.print("L"+String(freex)+","+String(ESP.getFreeHeap())+" ");
+  if (HeapMonitor::isTight() && now - lastShowLow > 500) {
+    Serial.print("L "+HeapMonitor::toString()+" ");
     lastShowLow = now;
   }
   
+  if (now - lastShowPeriods > 5000) {
+    // the fixed rate task
+    uint32_t periodMisses = camera.periodStats().misses;
+    if (periodMisses != lastPeriodMisses || showDebug) {
+      Serial.println("P cam "+camera.periodStats().toString()+" motor "+motor.getCommandStats());
+      lastPeriodMisses = periodMisses;
+    }
+    lastShowPeriods = now;
+  }
+
   uint8_t wifiClientCount = WiFi.softAPgetStationNum();
 
   if (wifiClientCount != lastWifiClientCount) {
@@ -158,11 +322,15 @@ void loop()
   
   imageServer.drive(&serverBufferOne, &serverBufferOther);
 
+#if CHANNEL_RESCAN
+  rescanIfErroneous(now);
+#endif
+
   // TODO emergency release if buffer is blocked somehow?
 
   if (showDebug) {
     if (now - lastShowAlive > 5000) {
-      Serial.print("IST "+imageServer.getState()+" ");
+      Serial.print("IST "+imageServer.getState()+" link "+imageServer.getLinkQuality()->toString(now)+" ");
       lastShowAlive = now;
     }
   }
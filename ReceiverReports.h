@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __RECEIVER_REPORTS_H__
+#define __RECEIVER_REPORTS_H__
+
+#include <IPAddress.h>
+
+/**
+ * The 'MR' packet a client sends about once a second: type, fps (in 0.1), packet loss before repair
+ * (per mille), frame jitter (micros), timestamp of the newest complete frame, decode time (micros).
+ * All values are about the time since the previous report.
+ */
+struct ReceiverReport
+{
+  static const uint8_t SIZE = 18;
+
+  uint16_t fpsTenths = 0;
+  uint16_t lossPerMille = 0;
+  uint32_t jitterMicros = 0;
+  uint32_t highestCompleteFrame = 0;
+  uint32_t decodeMicros = 0;
+
+  bool parse(const uint8_t* packet, int len)
+  {
+    if (len != SIZE || packet[0] != 'M' || packet[1] != 'R') {
+      return false;
+    }
+
+    fpsTenths = readUint16(&packet[2]);
+    lossPerMille = readUint16(&packet[4]);
+    jitterMicros = readUint32(&packet[6]);
+    highestCompleteFrame = readUint32(&packet[10]);
+    decodeMicros = readUint32(&packet[14]);
+
+    return lossPerMille <= 1000;
+  }
+
+private:
+  static uint16_t readUint16(const uint8_t* source)
+  {
+    return (source[0] << 8) | source[1];
+  }
+
+  static uint32_t readUint32(const uint8_t* source)
+  {
+    return ((uint32_t)source[0] << 24) | ((uint32_t)source[1] << 16) | ((uint32_t)source[2] << 8) | source[3];
+  }
+};
+
+/**
+ * Link quality per client, smoothed over its receiver reports.
+ * Meant for send decisions (pacing, redundancy, resolution): they should follow the worst client.
+ */
+class LinkQuality
+{
+public:
+  static const uint8_t MAX_CLIENTS = 4;
+  static const uint32_t STALE_MILLIS = 5000; // a client without reports for so long is not considered
+
+  struct Client
+  {
+    IPAddress address;
+    uint32_t reportCount = 0;
+    uint32_t lastReportMillis = 0;
+    uint16_t fpsTenths = 0; // smoothed like the loss
+    uint16_t lossPerMille = 0;
+    uint32_t jitterMicros = 0;
+    uint32_t decodeMicros = 0;
+    uint32_t highestCompleteFrame = 0;
+    uint32_t frameLagMillis = 0; // newest sent frame - newest complete frame at the client
+  };
+
+private:
+  Client clients[MAX_CLIENTS];
+
+public:
+  void update(IPAddress address, const ReceiverReport& report, uint32_t lastSentTimestamp, uint32_t now)
+  {
+    Client* client = find(address, now);
+
+    if (client->reportCount == 0) {
+      client->fpsTenths = report.fpsTenths;
+      client->lossPerMille = report.lossPerMille;
+    } else {
+      // one bad second should show, but not dominate
+      client->fpsTenths = (3 * client->fpsTenths + report.fpsTenths + 2) / 4;
+      client->lossPerMille = (3 * client->lossPerMille + report.lossPerMille + 2) / 4;
+    }
+    client->jitterMicros = report.jitterMicros;
+    client->decodeMicros = report.decodeMicros;
+    if (report.highestCompleteFrame > client->highestCompleteFrame) {
+      client->highestCompleteFrame = report.highestCompleteFrame;
+    }
+    client->frameLagMillis = lastSentTimestamp > client->highestCompleteFrame ? lastSentTimestamp - client->highestCompleteFrame : 0;
+    client->lastReportMillis = now;
+    client->reportCount++;
+  }
+
+  bool isFresh(const Client& client, uint32_t now) const
+  {
+    return client.reportCount > 0 && now - client.lastReportMillis < STALE_MILLIS;
+  }
+
+  /**
+   * @return NULL if no client reports (ie an old client)
+   */
+  const Client* worstClient(uint32_t now) const
+  {
+    const Client* worst = NULL;
+    for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+      if (isFresh(clients[i], now) && (worst == NULL || clients[i].lossPerMille > worst->lossPerMille)) {
+        worst = &clients[i];
+      }
+    }
+
+    return worst;
+  }
+
+  String toString(uint32_t now) const
+  {
+    String result = "";
+    for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+      const Client& client = clients[i];
+      if (!isFresh(client, now)) {
+        continue;
+      }
+
+      result += (result.length() > 0 ? " c" : "c")+String(client.address[3])+" fps "+String(client.fpsTenths / 10.0f, 1)
+        +" loss "+String(client.lossPerMille / 10.0f, 1)+"% jitter "+String(client.jitterMicros)+" lag "+String(client.frameLagMillis)
+        +"ms decode "+String(client.decodeMicros);
+    }
+
+    return result.length() > 0 ? result : "-";
+  }
+
+private:
+  /**
+   * The entry of the client; a new one replaces the stalest.
+   */
+  Client* find(IPAddress address, uint32_t now)
+  {
+    Client* oldest = &clients[0];
+    for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+      if (clients[i].reportCount > 0 && clients[i].address == address) {
+        return &clients[i];
+      }
+      if (clients[i].reportCount == 0 || (oldest->reportCount > 0 && now - clients[i].lastReportMillis > now - oldest->lastReportMillis)) {
+        oldest = &clients[i];
+      }
+    }
+
+    *oldest = Client();
+    oldest->address = address;
+    return oldest;
+  }
+};
+
+#endif
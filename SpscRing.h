@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __SPSC_RING_H__
+#define __SPSC_RING_H__
+
+/**
+ * A lock free ring for exactly one producer task and one consumer task.
+ * Holds SIZE - 1 elements at most.
+ */
+template<typename T, uint16_t SIZE>
+class SpscRing
+{
+private:
+  T elements[SIZE];
+  volatile uint16_t head = 0; // written by producer only
+  volatile uint16_t tail = 0; // written by consumer only
+
+public:
+  bool push(const T& element)
+  {
+    uint16_t next = (head + 1) % SIZE;
+    if (next == tail) {
+      return false;
+    }
+
+    elements[head] = element;
+    __sync_synchronize(); // element must be complete before it is visible
+    head = next;
+
+    return true;
+  }
+
+  bool pop(T* element)
+  {
+    if (tail == head) {
+      return false;
+    }
+
+    __sync_synchronize();
+    *element = elements[tail];
+    __sync_synchronize(); // element must be read before its slot is given back
+    tail = (tail + 1) % SIZE;
+
+    return true;
+  }
+
+  bool isEmpty()
+  {
+    return tail == head;
+  }
+
+  uint16_t count()
+  {
+    return (head + SIZE - tail) % SIZE;
+  }
+};
+
+#endif
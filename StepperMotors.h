@@ -19,12 +19,55 @@
 
 #include <math.h>
 #include "Task.h"
+#include "SpscRing.h"
+
+/**
+ * A movement request or a trajectory point from the network side; only the motor task applies it.
+ * Both kinds go through one ring: a move ends the points requested before it, but not the ones after it.
+ */
+struct MotionCommand
+{
+  bool isPathPoint;
+  float rightSpeed;
+  float leftSpeed;
+  uint16_t durationMillis; // move only
+  bool setsRight; // move only
+  bool setsLeft; // move only
+  uint32_t atMillis; // path point only
+  uint32_t issuedMicros;
+};
+
+/**
+ * One point of a streamed trajectory: wheel speeds to be reached at a rover time.
+ */
+struct TrajectoryPoint
+{
+  uint32_t atMillis;
+  float rightSpeed;
+  float leftSpeed;
+};
 
 class StepperMotors: public Task
 {
 private:
   const float DEAD_ZONE_SPEED_LOW = 0.02; // have _some_ movement also for very low speeds
   
+  static const uint8_t TRAJECTORY_STEP_MILLIS = 4; // speed updates while following a trajectory
+  static const uint8_t TRAJECTORY_SIZE = 32;
+  static const uint16_t LAST_POINT_MILLIS = 1000; // the speeds of the last point hold like a move without duration
+
+  SpscRing<MotionCommand, TRAJECTORY_SIZE + 16 + 1> commands;
+  uint32_t droppedCommands = 0;
+  uint32_t appliedCommands = 0;
+  uint32_t commandLatencySum = 0; // micros
+  uint32_t commandLatencyMax = 0;
+
+  TrajectoryPoint trajectory[TRAJECTORY_SIZE]; // only used by the motor task
+  uint8_t trajectoryCount = 0;
+  volatile uint8_t publishedTrajectoryDepth = 0;
+  uint32_t queuedPoints = 0; // written by the network side only
+  volatile uint32_t takenPoints = 0; // written by the motor task only
+  
   uint32_t systemStart;
   // the externally (or automatically) requested values
   float motorRSpeedDesired = 0;
@@ -35,6 +78,8 @@ private:
   uint32_t motorLEndTime;
   uint32_t lastDriveLoopTime = 0;
   uint32_t lastCounterOutTime = 0;
+  uint32_t notifiedWakes = 0;
+  uint32_t timedWakes = 0;
   bool holding = false;
 
   uint8_t stepPinRight;
@@ -93,10 +138,16 @@ public:
     systemStart = millis();
   }
 
+  /**
+   * Sleeps until a request comes or the current movement needs a change.
+   */
   void run()
   {
     while (true) {
       uint32_t now = millis();
+
+      applyCommands(now);
+      applyTrajectory(now);
   
       if (lastDriveLoopTime > 0) {
         uint16_t passed = now - lastDriveLoopTime;
@@ -117,18 +168,26 @@ public:
 
       if (now - lastCounterOutTime > 1200) {
         //Serial.println("R r"+String(rSpeed)+" L r"+String(lSpeed));
+        if (showDebug) {
+          Serial.println("MC "+getCommandStats());
+        }
         
         lastCounterOutTime = now;
       }
   
       lastDriveLoopTime = now;
 
-      sleepAfterLoop(4, now);
+      if (waitForNotification(millisToNextChange(now))) {
+        notifiedWakes++;
+      } else {
+        timedWakes++;
+      }
     }
   }
 
   void hold() {
     holding = !holding;
+    notify();
   }
 
   void requestMovement(float forward, float right, uint16_t durationMillis = 1000) {
@@ -139,42 +198,72 @@ public:
     rightSpeed -= right / 2;
     leftSpeed += right / 2;
     
-    requestRight(rightSpeed, durationMillis);
-    requestLeft(leftSpeed, durationMillis);
+    request(rightSpeed, leftSpeed, true, true, durationMillis);
   }
 
   void requestRight(float value, uint16_t durationMillis = 1000)
   {
     // TODO check for value range?
     
-    uint32_t now = millis();
-    motorRSpeedDesired = value;
-    motorREndTime = now + durationMillis;
+    request(value, 0, true, false, durationMillis);
   }
   
   void requestLeft(float value, uint16_t durationMillis = 1000)
   {
-    uint32_t now = millis();
-    motorLSpeedDesired = value;
-    motorLEndTime = now + durationMillis;
+    request(0, value, false, true, durationMillis);
   }  
   
   void requestForward(float value, uint16_t durationMillis = 1000)
   {
-    uint32_t desiredEndTime = millis() + durationMillis;
-    motorRSpeedDesired = value;
-    motorREndTime = desiredEndTime;
-    motorLSpeedDesired = value;
-    motorLEndTime = desiredEndTime;
+    request(value, value, true, true, durationMillis);
   }
   
   void requestReverse(float value, uint16_t durationMillis = 1000)
   {
-    uint32_t desiredEndTime = millis() + durationMillis;
-    motorRSpeedDesired = -value;
-    motorREndTime = desiredEndTime;
-    motorLSpeedDesired = -value;
-    motorLEndTime = desiredEndTime;
+    request(-value, -value, true, true, durationMillis);
+  }
+
+  /**
+   * Queues a point of a trajectory. Points must come in time order; a point earlier than
+   * already buffered ones replaces those. The speeds of the last point hold for LAST_POINT_MILLIS
+   * (a trajectory that should stop ends with a point of speed 0).
+   */
+  bool requestTrajectoryPoint(uint32_t atMillis, float rightSpeed, float leftSpeed)
+  {
+    MotionCommand command;
+    command.isPathPoint = true;
+    command.rightSpeed = rightSpeed;
+    command.leftSpeed = leftSpeed;
+    command.durationMillis = 0;
+    command.setsRight = true;
+    command.setsLeft = true;
+    command.atMillis = atMillis;
+    command.issuedMicros = micros();
+
+    bool accepted = commands.push(command);
+    if (accepted) {
+      queuedPoints++;
+    }
+    notify();
+    return accepted;
+  }
+
+  /**
+   * Number of trajectory points not yet passed.
+   */
+  uint8_t trajectoryDepth()
+  {
+    return publishedTrajectoryDepth + (queuedPoints - takenPoints);
+  }
+
+  /**
+   * Average and maximum time (micros) from a request until the motor task applied it.
+   */
+  String getCommandStats()
+  {
+    uint32_t average = appliedCommands > 0 ? commandLatencySum / appliedCommands : 0;
+    return String(appliedCommands)+" avg "+String(average)+" max "+String(commandLatencyMax)+" dropped "+String(droppedCommands)
+      +" wakes "+String(notifiedWakes)+"+"+String(timedWakes);
   }
 
 private:
@@ -184,6 +273,132 @@ private:
     pinMode(num, OUTPUT);
   }
 
+  // NOTE called by the network side (producer)
+  void request(float rightSpeed, float leftSpeed, bool setsRight, bool setsLeft, uint16_t durationMillis)
+  {
+    MotionCommand command;
+    command.isPathPoint = false;
+    command.rightSpeed = rightSpeed;
+    command.leftSpeed = leftSpeed;
+    command.durationMillis = durationMillis;
+    command.setsRight = setsRight;
+    command.setsLeft = setsLeft;
+    command.atMillis = 0;
+    command.issuedMicros = micros();
+
+    if (!commands.push(command)) {
+      droppedCommands++;
+    }
+    notify();
+  }
+
+  /**
+   * Millis until the speeds change without a new request: the next end time of a moving motor
+   * or the next trajectory step. 0 for nothing to do.
+   */
+  uint32_t millisToNextChange(uint32_t now)
+  {
+    uint32_t next = 0;
+    if (motorRSpeedDesired != 0) {
+      next = _max(1, (int32_t)(motorREndTime - now));
+    }
+    if (motorLSpeedDesired != 0) {
+      uint32_t nextLeft = _max(1, (int32_t)(motorLEndTime - now));
+      next = next == 0 ? nextLeft : _min(next, nextLeft);
+    }
+
+    // a running move still ends in time when the next point is far away
+    if (trajectoryCount > 0) {
+      int32_t untilStart = trajectory[0].atMillis - now;
+      uint32_t nextPoint = untilStart > 0 ? untilStart : TRAJECTORY_STEP_MILLIS;
+      next = next == 0 ? nextPoint : _min(next, nextPoint);
+    }
+
+    return next;
+  }
+
+  void applyCommands(uint32_t now)
+  {
+    MotionCommand command;
+    while (commands.pop(&command)) {
+      uint32_t latency = micros() - command.issuedMicros;
+      appliedCommands++;
+      commandLatencySum += latency;
+      commandLatencyMax = _max(commandLatencyMax, latency);
+
+      if (command.isPathPoint) {
+        addTrajectoryPoint(command);
+        takenPoints++;
+        continue;
+      }
+
+      // the duration counts from the request
+      uint32_t endTime = now + command.durationMillis - latency / 1000;
+
+      if (command.setsRight) {
+        motorRSpeedDesired = command.rightSpeed;
+        motorREndTime = endTime;
+      }
+
+      if (command.setsLeft) {
+        motorLSpeedDesired = command.leftSpeed;
+        motorLEndTime = endTime;
+      }
+
+      // a direct request ends a running trajectory
+      trajectoryCount = 0;
+    }
+  }
+
+  void addTrajectoryPoint(const MotionCommand& command)
+  {
+    while (trajectoryCount > 0 && (int32_t)(trajectory[trajectoryCount - 1].atMillis - command.atMillis) >= 0) {
+      trajectoryCount--;
+    }
+
+    if (trajectoryCount < TRAJECTORY_SIZE) {
+      TrajectoryPoint* point = &trajectory[trajectoryCount++];
+      point->atMillis = command.atMillis;
+      point->rightSpeed = command.rightSpeed;
+      point->leftSpeed = command.leftSpeed;
+    }
+  }
+
+  void applyTrajectory(uint32_t now)
+  {
+    // drop the points that are passed
+    uint8_t passed = 0;
+    while (passed + 1 < trajectoryCount && (int32_t)(now - trajectory[passed + 1].atMillis) >= 0) {
+      passed++;
+    }
+    if (passed > 0) {
+      memmove(trajectory, &trajectory[passed], (trajectoryCount - passed) * sizeof(TrajectoryPoint));
+      trajectoryCount -= passed;
+    }
+
+    if (trajectoryCount > 0 && (int32_t)(now - trajectory[0].atMillis) >= 0) {
+      if (trajectoryCount == 1) {
+        // the last point: its speeds hold like a move
+        motorRSpeedDesired = trajectory[0].rightSpeed;
+        motorLSpeedDesired = trajectory[0].leftSpeed;
+        motorREndTime = trajectory[0].atMillis + LAST_POINT_MILLIS;
+        motorLEndTime = motorREndTime;
+        trajectoryCount = 0;
+      } else {
+        TrajectoryPoint* from = &trajectory[0];
+        TrajectoryPoint* to = &trajectory[1];
+        float part = (now - from->atMillis) / (float)(to->atMillis - from->atMillis);
+
+        motorRSpeedDesired = from->rightSpeed + part * (to->rightSpeed - from->rightSpeed);
+        motorLSpeedDesired = from->leftSpeed + part * (to->leftSpeed - from->leftSpeed);
+        motorREndTime = to->atMillis;
+        motorLEndTime = to->atMillis;
+      }
+    }
+
+    publishedTrajectoryDepth = trajectoryCount;
+  }
+
   void switchMotorR(double pwmValue)
   {
     // TODO consider getNonDeadSpeed
@@ -17,7 +17,12 @@
 #ifndef __SYNCED_MEMORY_BUFFER_H__
 #define __SYNCED_MEMORY_BUFFER_H__
 
+#include "FrameTrace.h"
+#include "FrameProfile.h"
+#include <esp_heap_caps.h>
+
 const uint32_t BUFFER_SIZE = 35000;
+const uint32_t EXTERNAL_BUFFER_SIZE = 300000; // 1600x1200 frames; the FIFO of the camera has 384k
 
 class SyncedMemoryBuffer
 {
@@ -26,9 +31,20 @@ private:
   uint32_t maxBufferSize = 0;
   uint32_t currentTimestamp = 0;
   uint32_t currentContentSize = 0;
+  uint32_t currentFingerprint = 0;
+  FrameProfile currentProfile;
+  FrameTrace currentTrace;
   SemaphoreHandle_t semaphore;
+#if configSUPPORT_STATIC_ALLOCATION
+  StaticSemaphore_t semaphoreStorage;
+#endif
   String currentOwner = "";
   bool taken = false;
+  volatile uint32_t readers = 0;
+  bool external = false;
+  volatile uint32_t currentValidBytes = 0;
+  volatile uint32_t currentGrowingSize = 0;
+  volatile uint32_t currentGrowingTimestamp = 0;
   
 public:
   SyncedMemoryBuffer()
@@ -45,6 +61,50 @@ public:
     semaphore = xSemaphoreCreateMutex();
   }
 
+  /**
+   * Uses the given (ie static) storage instead of the heap; also for the semaphore if possible.
+   */
+  void setup(byte* storage, uint32_t size)
+  {
+    buffer = storage;
+    maxBufferSize = size;
+    memset(buffer, 0, size);
+    buffer[0] = 0xff;
+
+#if configSUPPORT_STATIC_ALLOCATION
+    semaphore = xSemaphoreCreateMutexStatic(&semaphoreStorage);
+#else
+    semaphore = xSemaphoreCreateMutex();
+#endif
+  }
+
+  /**
+   * Frame storage in PSRAM for both buffers, or for neither (then nothing stays allocated):
+   * for high resolutions, leaves internal RAM to WiFi and lwIP.
+   * NOTE SPI reads and packet sends should go through internal (bounce) buffers.
+   */
+  static bool setupExternal(SyncedMemoryBuffer* one, SyncedMemoryBuffer* other, uint32_t size)
+  {
+    byte* storageOne = (byte *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    byte* storageOther = (byte *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (storageOne == NULL || storageOther == NULL) {
+      heap_caps_free(storageOne);
+      heap_caps_free(storageOther);
+      return false;
+    }
+
+    one->setup(storageOne, size);
+    one->external = true;
+    other->setup(storageOther, size);
+    other->external = true;
+    return true;
+  }
+
+  bool isExternal()
+  {
+    return external;
+  }
+
   uint32_t maxSize()
   {
     return maxBufferSize;
@@ -70,8 +130,14 @@ public:
       } else {
         currentTimestamp = timestamp;
       }
+
+      currentTrace.published = micros();
+      currentTrace.firstSent = 0;
+      currentTrace.lastSent = 0;
     }
 
+    currentGrowingSize = 0;
+
     currentOwner = "";
     
     xSemaphoreGive(semaphore);
@@ -83,6 +149,72 @@ public:
     memcpy(other->buffer, buffer, currentContentSize);
     other->currentContentSize = currentContentSize;
     other->currentTimestamp = currentTimestamp;
+    other->currentTrace = currentTrace;
+    other->currentFingerprint = currentFingerprint;
+    other->currentProfile = currentProfile;
+  }
+
+  /**
+   * Marks the content as still being read after the semaphore was released (or without it while growing).
+   * The camera does not overwrite a pinned buffer.
+   */
+  void pin()
+  {
+    __sync_fetch_and_add(&readers, 1);
+  }
+
+  void unpin()
+  {
+    uint32_t current = readers;
+    while (current > 0 && !__sync_bool_compare_and_swap(&readers, current, current - 1)) {
+      current = readers;
+    }
+  }
+
+  bool isPinned()
+  {
+    return readers > 0;
+  }
+
+  /**
+   * The writer (holding the semaphore) announces a new frame of this size; readers may then
+   * use the content up to validBytes() without the semaphore. Ends with release().
+   */
+  void beginGrowing(uint32_t expectedSize, uint32_t timestamp)
+  {
+    currentValidBytes = 0;
+    currentGrowingTimestamp = timestamp;
+    __sync_synchronize();
+    currentGrowingSize = expectedSize;
+  }
+
+  void grow(uint32_t validBytes)
+  {
+    // content before the watermark
+    __sync_synchronize();
+    currentValidBytes = validBytes;
+  }
+
+  bool isGrowing()
+  {
+    return currentGrowingSize > 0;
+  }
+
+  uint32_t growingSize()
+  {
+    return currentGrowingSize;
+  }
+
+  uint32_t growingTimestamp()
+  {
+    return currentGrowingTimestamp;
+  }
+
+  uint32_t validBytes()
+  {
+    uint32_t valid = currentValidBytes;
+    __sync_synchronize();
+    return valid;
   }
 
   String taker()
@@ -101,6 +233,60 @@ public:
     return buffer;
   }
 
+  /**
+   * Continues a (FNV-1a like) hash over data, a word at a time where possible.
+   * NOTE data should be word aligned.
+   */
+  static uint32_t hashContent(uint32_t hash, const byte* data, uint32_t length)
+  {
+    if (hash == 0) {
+      hash = 2166136261UL;
+    }
+
+    const uint32_t* words = (const uint32_t*)data;
+    uint32_t wordCount = length / 4;
+    for (uint32_t i = 0; i < wordCount; i++) {
+      hash = (hash ^ words[i]) * 16777619UL;
+    }
+
+    for (uint32_t i = wordCount * 4; i < length; i++) {
+      hash = (hash ^ data[i]) * 16777619UL;
+    }
+
+    return hash;
+  }
+
+  /**
+   * Hash of the content; must be set by the writer before release().
+   */
+  void setFingerprint(uint32_t fingerprint)
+  {
+    currentFingerprint = fingerprint;
+  }
+
+  uint32_t fingerprint()
+  {
+    return currentFingerprint;
+  }
+
+  /**
+   * Like the fingerprint: set by the writer before release().
+   */
+  void setProfile(const FrameProfile& profile)
+  {
+    currentProfile = profile;
+  }
+
+  const FrameProfile& profile()
+  {
+    return currentProfile;
+  }
+
+  FrameTrace* trace()
+  {
+    return &currentTrace;
+  }
+
   uint32_t timestamp()
   {
     return currentTimestamp;
@@ -17,32 +17,98 @@
 #ifndef __RTOS_TASK_WRAPPER_H__
 #define __RTOS_TASK_WRAPPER_H__
 
+/**
+ * Stack (in bytes as everything on the ESP32) and control block of a task; for allocating it at build time.
+ */
+template<uint32_t STACK_SIZE>
+struct TaskMemory
+{
+  StackType_t stack[STACK_SIZE];
+#if configSUPPORT_STATIC_ALLOCATION
+  StaticTask_t control;
+#endif
+};
+
+/**
+ * Jitter (deviation of the time between two wake ups from the period) of a periodic task
+ * and the periods where the loop took too long.
+ */
+struct PeriodStats
+{
+  uint32_t periods = 0;
+  uint32_t misses = 0;
+  uint32_t maxJitterMicros = 0;
+  uint64_t sumJitterMicros = 0;
+
+  String toString()
+  {
+    uint32_t averageJitter = periods > 0 ? sumJitterMicros / periods : 0;
+    return String(periods)+" miss "+String(misses)+" jitter "+String(averageJitter)+"/"+String(maxJitterMicros)+"us";
+  }
+};
+
 class Task
 {
 
 private:
-  xTaskHandle taskHandle;
+  xTaskHandle volatile taskHandle = NULL; // set by the task itself before it can wait for anything
   bool isTasked = false;
+  int64_t nextDeadlineMicros = 0;
+  int64_t lastWakeMicros = 0;
+  TickType_t lastWakeTicks = 0;
+  uint32_t tickRemainderMicros = 0;
+  PeriodStats currentPeriodStats;
 
 public:
   void start(String name, UBaseType_t uxPriority = 1, uint16_t stackSize = 5000)
   {
     isTasked = true;
     // TODO what is a reasonable stack size?
-    ::xTaskCreate(&runTask, name.c_str(), stackSize, this, uxPriority, &taskHandle);
+    ::xTaskCreate(&runTask, name.c_str(), stackSize, this, uxPriority, NULL);
     // TODO could also use ..PinnedToCore(... tskNO_AFFINITY);
   }
 
+  /**
+   * Does not use the heap (if the FreeRTOS config supports it).
+   */
+  template<uint32_t STACK_SIZE>
+  void start(String name, UBaseType_t uxPriority, TaskMemory<STACK_SIZE>* memory)
+  {
+#if configSUPPORT_STATIC_ALLOCATION
+    isTasked = true;
+    ::xTaskCreateStatic(&runTask, name.c_str(), STACK_SIZE, this, uxPriority, memory->stack, &memory->control);
+#else
+    start(name, uxPriority, STACK_SIZE);
+#endif
+  }
+
   virtual void run() = 0;
+
+  PeriodStats periodStats()
+  {
+    return currentPeriodStats;
+  }
+
+  /**
+   * Wakes the task from waitForNotification(); can be called from other tasks.
+   * Before the task runs there is nothing to wake (it looks for work before its first wait).
+   */
+  void notify()
+  {
+    xTaskHandle handle = taskHandle;
+    if (handle != NULL) {
+      ::xTaskNotifyGive(handle);
+    }
+  }
   
 protected:
   // TODO what is the difference to delay() and yield()? Is this necessary?
   void delay(uint16_t ms)
   {
     if (isTasked)
-      ::vTaskDelay(ms / portTICK_PERIOD_MS);
+      ::vTaskDelay((ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS); // at least the time given
     else
-      delay(ms);
+      ::delay(ms);
   }
 
   void yield()
@@ -50,7 +116,87 @@ protected:
     if (isTasked)
       taskYIELD();
     else
-      yield();
+      ::yield();
+  }
+
+  /**
+   * Sleeps until notify() or the timeout (millis; 0 for none). Returns true if notified.
+   */
+  bool waitForNotification(uint32_t timeoutMillis)
+  {
+    TickType_t ticks = timeoutMillis == 0 ? portMAX_DELAY : (timeoutMillis + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+    return ::ulTaskNotifyTake(pdTRUE, ticks) > 0;
+  }
+
+  /**
+   * For loops with a fixed rate: sleeps until the next deadline, which is one period after the last one
+   * (not after the end of the loop like sleepAfterLoop()). Deadlines are kept in micros; the sleeping
+   * is in whole ticks with vTaskDelayUntil, carrying the remainder over to the next period.
+   * A loop ending after its next deadline counts as a miss, sleeps one tick and restarts the schedule.
+   * Periods are at least one tick: a task must sleep every period, otherwise lower priority tasks
+   * (and the idle task feeding the watchdog) starve.
+   */
+  void waitForNextPeriod(uint32_t periodMicros)
+  {
+    int64_t now = esp_timer_get_time();
+    const uint32_t tickMicros = portTICK_PERIOD_MS * 1000;
+    periodMicros = _max(periodMicros, tickMicros);
+
+    if (nextDeadlineMicros == 0) {
+      nextDeadlineMicros = now;
+      lastWakeTicks = xTaskGetTickCount();
+    }
+
+    nextDeadlineMicros += periodMicros;
+    if (now >= nextDeadlineMicros) {
+      currentPeriodStats.misses++;
+      restartPeriods();
+      if (isTasked) {
+        ::vTaskDelay(1);
+      } else {
+        yield();
+      }
+      return;
+    }
+
+    tickRemainderMicros += periodMicros;
+    TickType_t periodTicks = tickRemainderMicros / tickMicros;
+    tickRemainderMicros -= periodTicks * tickMicros;
+
+    if (isTasked) {
+      ::vTaskDelayUntil(&lastWakeTicks, periodTicks); // at least one tick (see above)
+    } else {
+      // the main loop: nothing below it to starve
+      lastWakeTicks += periodTicks;
+      while (esp_timer_get_time() < nextDeadlineMicros) {
+        yield();
+      }
+    }
+
+    int64_t wake = esp_timer_get_time();
+    if (lastWakeMicros > 0) {
+      int64_t jitter = wake - lastWakeMicros - periodMicros;
+      if (jitter < 0) {
+        jitter = -jitter;
+      }
+      currentPeriodStats.periods++;
+      currentPeriodStats.sumJitterMicros += jitter;
+      if (jitter > currentPeriodStats.maxJitterMicros) {
+        currentPeriodStats.maxJitterMicros = jitter;
+      }
+    }
+    lastWakeMicros = wake;
+  }
+
+  /**
+   * The next waitForNextPeriod() starts a new schedule from its call, without a miss or jitter;
+   * for loops where only some passes are periodic.
+   */
+  void restartPeriods()
+  {
+    nextDeadlineMicros = 0;
+    tickRemainderMicros = 0;
+    lastWakeMicros = 0;
   }
 
   void sleepAfterLoop(uint16_t maxMillis, uint32_t loopStart)
@@ -66,6 +212,8 @@ private:
   static void runTask(void *pTaskInstance)
   {
     Task* pTask = (Task*)pTaskInstance;
+    // a higher priority task runs before xTaskCreate..() returns a handle
+    pTask->taskHandle = ::xTaskGetCurrentTaskHandle();
     pTask->run();
     pTask->cleanup();
   }
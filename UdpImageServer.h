@@ -20,20 +20,126 @@
 #include <WiFiUdp.h>
 #include "SyncedMemoryBuffer.h"
 #include "ContinuousControl.h"
-#include <math.h>
+#include "ZeroCopyUdpSender.h"
+#include "HeapMonitor.h"
+#include "ReceiverReports.h"
 
 #define DATA_SIZE 1200 // NOTE does not work for smaller sizes (ie 500 bytes: 6x as long transfer time...)
+#define UNCHANGED_BAND_TOLERANCE 40 // per mille of each band of the frame profile; covers the sensor noise of a still scene
+#define UNCHANGED_SIZE_TOLERANCE 10 // per mille of the size; only for frames without restart markers (no profile)
+#define UNCHANGED_REFRESH_MILLIS 1000 // send a full frame at least this often
+#define JPEG_HEADER_MAX 1024 // OV2640 tables up to the scan are about 600 bytes
+#define JPEG_HEADER_REPEAT_MILLIS 2000 // for clients joining late
+#define CLIENT_EXPIRE_MILLIS 5000 // a client without packets for so long does not count for the header decision
+#define CUT_THROUGH true // send the packets of a frame while the camera still copies it (not while the scene is still)
+#define ZERO_COPY_SEND true // image packets reference the frame buffer instead of going through WiFiUDP
+// IP TOS bytes (DSCP << 2, not DSCP values) of the two traffic classes; the WMM user priority is their upper three bits
+#define TOS_CONTROL 0xc0 // DSCP 48 (CS6): voice (EF, DSCP 46, would be user priority 5: only video)
+#define TOS_IMAGE 0x88 // DSCP 34 (AF41): video
+
+/**
+ * Layout of the 'RI'/'RJ' image packets: type, timestamp, packet number, packet count[, header id], data.
+ */
+struct ImagePacket
+{
+  static constexpr uint8_t NUMBER_OFFSET = 6;
+  static constexpr uint8_t HEADER_SIZE = 10;
+  static constexpr uint16_t MAX_SIZE = HEADER_SIZE + 1 + DATA_SIZE;
+
+  static constexpr uint16_t packetCount(uint32_t payloadSize)
+  {
+    return (payloadSize + DATA_SIZE - 1) / DATA_SIZE;
+  }
+
+  static constexpr uint32_t dataOffset(uint16_t packetNumber)
+  {
+    return (uint32_t)packetNumber * DATA_SIZE;
+  }
+
+  static constexpr uint16_t dataSize(uint16_t packetNumber, uint32_t payloadSize)
+  {
+    return payloadSize - dataOffset(packetNumber) < DATA_SIZE ? payloadSize - dataOffset(packetNumber) : DATA_SIZE;
+  }
+
+  static constexpr uint8_t headerSize(bool withHeaderId)
+  {
+    return withHeaderId ? HEADER_SIZE + 1 : HEADER_SIZE + 0;
+  }
+};
+
+/**
+ * A client as seen from its packets; whether it can splice cached headers ('RJ') is only known after its 'MH'.
+ */
+struct UdpClient
+{
+  IPAddress address;
+  uint32_t lastPacketMillis = 0;
+  bool knowsHeaders = false;
+};
+
+/**
+ * What is the same for all packets of one frame; computed once per frame.
+ */
+struct PacketPlan
+{
+  byte* payload = NULL;
+  uint32_t payloadSize = 0;
+  uint16_t packetCount = 0;
+  uint8_t headerSize = 0;
+  bool external = false; // payload in PSRAM
+  byte header[ImagePacket::HEADER_SIZE + 1];
+};
+
+/**
+ * How a frame was split when it was sent; repairs must use the same packet offsets.
+ */
+struct SentPlan
+{
+  uint32_t timestamp = 0;
+  uint16_t headerLength = 0;
+  uint8_t headerId = 0;
+};
 
 class UdpImageServer : public WiFiUDP
 {
 private:
   uint16_t udpPort;
+  IPAddress broadcastAddress = IPAddress(192, 168, 151, 255);
+  byte packetBuffer[ImagePacket::MAX_SIZE];
+  ZeroCopyUdpSender imageSender; // also 'RH' and 'RU' so they stay in order with the image packets
+  ZeroCopyUdpSender controlSender; // answers and telemetry; never waits behind image packets
+  uint32_t copiedBytes = 0; // image packets: by the sending code, lwIP and the WiFi driver
+  uint32_t sentFrames = 0;
   uint32_t lastSentTimestamp = 0;
+  uint32_t lastSentFingerprint = 0;
+  uint32_t lastSentSize = 0;
+  FrameProfile lastSentProfile;
+  uint32_t lastFullFrameMillis = 0;
+  uint32_t unchangedFrames = 0;
+  bool sceneIsStill = false; // the last frame was like the one before: the next is checked before it is sent
+  byte cachedHeader[JPEG_HEADER_MAX];
+  uint16_t cachedHeaderLength = 0;
+  uint8_t cachedHeaderId = 0;
+  uint32_t lastHeaderSentMillis = 0;
+  static const uint8_t MAX_CLIENTS = 4;
+  UdpClient clients[MAX_CLIENTS]; // older clients need complete 'RI' frames
+  SentPlan sentPlans[2]; // one per frame buffer
+  uint8_t nextSentPlan = 0;
+  SyncedMemoryBuffer* streamingBuffer = NULL; // pinned while its frame is sent before release
+  uint32_t streamingTimestamp = 0;
+  uint16_t streamingNextPacket = 0;
+  PacketPlan streamingPlan;
+  uint32_t streamingFirstSent = 0;
+  uint32_t cutThroughPackets = 0;
   uint32_t lastPacketMillis = 0;
-  uint8_t receiveBuffer[101];
+  uint8_t receiveBuffer[257]; // large enough for a "path" command
   uint32_t sentPackets = 0;
   uint32_t errorPackets = 0;
   uint32_t lastSentPacketsOut = 0;
+  FrameTraceStats traceStats;
+  int64_t clientClockOffset = 0; // as estimated and reported by the client: rover micros - client micros
+  uint32_t clientRoundTrip = 0;
+  LinkQuality linkQuality;
   ContinuousControl *control = NULL;
   
 public:
@@ -45,6 +151,15 @@ public:
 
   void begin() 
   {
+    // one socket per class: packets of a class go to the WMM queue of its access category
+    // all on the server port; the senders first so that WiFiUDP gets the received packets
+    if (ZERO_COPY_SEND && !imageSender.begin(udpPort, TOS_IMAGE)) {
+      Serial.println("!!!! Could not create netconn; sending images with WiFiUDP");
+    }
+    if (!controlSender.begin(udpPort, TOS_CONTROL)) {
+      Serial.println("!!!! Could not create netconn; sending control answers with WiFiUDP");
+    }
+
     WiFiUDP::begin(WiFi.localIP(), udpPort);
 
     // TODO does not work; remove in WiFiUdp.cpp?
@@ -58,10 +173,13 @@ public:
       return;
     }
 
-    uint32_t now = millis();
-    if (now - lastPacketMillis > 190) {
-      // Only then stable voltage readings are possible
-      control->triggerVoltageReading();
+    imageSender.discardReceived();
+    controlSender.discardReceived();
+
+    // a streamed frame cannot be checked for being unchanged (it is not complete)
+    if (CUT_THROUGH && !sceneIsStill && (imageDataOne->isGrowing() || imageDataOther->isGrowing())) {
+      // then wait below for the rest; the camera holds that semaphore until the copy is done
+      sendGrowingFrame(imageDataOne->isGrowing() ? imageDataOne : imageDataOther);
     }
 
     if (!imageDataOne->hasContent() && !imageDataOther->hasContent()) {
@@ -83,12 +201,17 @@ public:
     }
 
     int len = parsePacket();
+    int64_t receiveMicros = esp_timer_get_time();
 
     bool packetSentAlready = false;
     if (len > 0) {
       if (len < sizeof(receiveBuffer) - 1 && len > 2) {
         memset(receiveBuffer, 0, sizeof(receiveBuffer)); // esp null-terminates data...
         read(receiveBuffer, len);
+
+        // only an 'MH' shows that the client splices headers; any other packet (like 'MR') keeps it alive
+        bool knowsHeaders = receiveBuffer[0] == 'M' && receiveBuffer[1] == 'H' && len == 3;
+        noteClient(remoteIP(), knowsHeaders, millis());
         
         if (receiveBuffer[0] == 'M' && receiveBuffer[1] == 'N' && (len == 8 || len == 10 || len == 12)) {
           bool hasSecondPacket = len == 10;
@@ -117,19 +240,22 @@ public:
             imageDataOne->release();
           }
   
-          if (imageData != NULL) {
+          SentPlan* sentPlan = sentPlanOf(missingTimestamp);
+          if (imageData != NULL && sentPlan != NULL) {
             packetSentAlready = true;
-            writePacket(missing1, imageData);
+            PacketPlan plan;
+            planPackets(&plan, imageData, imageData->timestamp(), imageData->contentSize(), sentPlan->headerLength, sentPlan->headerId);
+            writePacket(missing1, &plan);
             // TODO
             delay(2);
             //Serial.print(""+String(missingTimestamp)+": "+String(missing1));
             if (hasSecondPacket) {
-              writePacket(missing2, imageData);
+              writePacket(missing2, &plan);
               delay(2);
               //Serial.print(", "+String(missing2));
             }
             if (hasThirdPacket) {
-              writePacket(missing3, imageData);
+              writePacket(missing3, &plan);
               delay(2);
               //Serial.print(", "+String(missing3));
             }
@@ -138,18 +264,51 @@ public:
           }
 
           Serial.print(" ");
+        } else if (receiveBuffer[0] == 'M' && receiveBuffer[1] == 'H' && len == 3) {
+          // Header missing (or first contact of a client that can splice headers)
+          if (cachedHeaderLength > 0) {
+            sendHeader();
+            packetSentAlready = true;
+          }
+        } else if (receiveBuffer[0] == 'M' && receiveBuffer[1] == 'R' && len == ReceiverReport::SIZE) {
+          ReceiverReport report;
+          if (report.parse(receiveBuffer, len)) {
+            linkQuality.update(remoteIP(), report, lastSentTimestamp, millis());
+          }
+        } else if (receiveBuffer[0] == 'T' && receiveBuffer[1] == 'P' && len == 22) {
+          // Clock ping: client time, then the client's current offset and round trip estimate
+          clientClockOffset = (int64_t)readUint64(&receiveBuffer[10]);
+          clientRoundTrip = readUint32(&receiveBuffer[18]);
+
+          // Answer only the sender (as fast as possible)
+          byte pong[26];
+          pong[0] = 'T';
+          pong[1] = 'P';
+          memcpy(&pong[2], &receiveBuffer[2], 8);
+          writeUint64(&pong[10], receiveMicros);
+          writeUint64(&pong[18], esp_timer_get_time());
+          sendPacket(&controlSender, remoteIP(), remotePort(), pong, sizeof(pong));
         } else if (receiveBuffer[0] == 'C' && receiveBuffer[1] == 'T') {
           String requested = String((char *)&(receiveBuffer[2]));  
         
           //Serial.print("CR "+requested+" ");
 
-          if (control->supports(requested)) {
+          if (requested.startsWith("stats")) {
+            sendControl("STATS "+traceStats.toString()+" sync "+String(clientRoundTrip)+" "+String((int32_t)(clientClockOffset / 1000))+"ms"
+              +" copied "+String(sentFrames > 0 ? copiedBytes / sentFrames : 0)+"/frame heap "+HeapMonitor::toString()
+              +" link "+linkQuality.toString(millis()));
+
+            if (requested.startsWith("stats reset")) {
+              traceStats.reset();
+              copiedBytes = 0;
+              sentFrames = 0;
+            }
+
+            packetSentAlready = true;
+          } else if (control->supports(requested)) {
             String returnValue = control->handle(requested);
 
-            beginPacket("192.168.151.255", udpPort);
-            print("CT");
-            print(returnValue);
-            finishPacket();
+            sendControl(returnValue);
 
             Serial.print("CR "+returnValue+" ");
 
@@ -181,20 +340,64 @@ public:
       }
 
       uint32_t t1 = millis();
-      if (imageData->timestamp() > lastSentTimestamp) {
-        uint16_t packetCountTotal = ceil(imageData->contentSize() / (float) DATA_SIZE);
+      bool continuesStream = imageData == streamingBuffer && imageData->timestamp() == streamingTimestamp;
+      if (!continuesStream) {
+        endStreaming();
+      }
+
+      if (imageData->timestamp() > lastSentTimestamp && !continuesStream && isUnchanged(imageData, t1)) {
+        // Only tell the client the frame it has is still current
+        byte unchanged[10];
+        unchanged[0] = 'R';
+        unchanged[1] = 'U';
+        writeUint32(&unchanged[2], lastSentTimestamp);
+        writeUint32(&unchanged[6], imageData->timestamp());
+        sendPacket(&imageSender, broadcastAddress, udpPort, unchanged, sizeof(unchanged));
+
+        unchangedFrames++;
+        sceneIsStill = true;
+        lastSentTimestamp = imageData->timestamp();
+      } else if (imageData->timestamp() > lastSentTimestamp) {
+        PacketPlan plan;
+        uint16_t firstPacket = 0;
+        if (continuesStream) {
+          plan = streamingPlan;
+          firstPacket = streamingNextPacket;
+        } else {
+          uint16_t headerLength = clientsKnowHeaders(t1) ? updateHeader(imageData->content(), imageData->contentSize(), t1) : 0;
+          planPackets(&plan, imageData, imageData->timestamp(), imageData->contentSize(), headerLength, cachedHeaderId);
+          rememberPlan(imageData->timestamp(), headerLength);
+        }
 
-        //Serial.print("+ of"+String(imageData->contentSize())+"c"+String(packetCountTotal)+" ");
+        //Serial.print("+ of"+String(imageData->contentSize())+"c"+String(plan.packetCount)+" ");
 
-        for (uint16_t num = 0; num < packetCountTotal; num++) {
-          writePacket(num, imageData);
+        FrameTrace* trace = imageData->trace();
+        if (firstPacket > 0) {
+          trace->firstSent = streamingFirstSent;
+        }
+        
+        for (uint16_t num = firstPacket; num < plan.packetCount; num++) {
+          writePacket(num, &plan);
+          if (num == 0) {
+            trace->firstSent = micros();
+          }
           // TODO return after some time?
           // TODO use a delay/yield here?
         }
         
         //Serial.println("e");
 
+        trace->lastSent = micros();
+        traceStats.record(trace);
+
+        sceneIsStill = isLikeLastSent(imageData);
         lastSentTimestamp = imageData->timestamp();
+        lastSentFingerprint = imageData->fingerprint();
+        lastSentSize = imageData->contentSize();
+        lastSentProfile = imageData->profile();
+        lastFullFrameMillis = t1;
+        sentFrames++;
+        endStreaming();
       }
       
       uint32_t t2 = millis();
@@ -202,7 +405,7 @@ public:
       if (sentPackets - lastSentPacketsOut > 600) {
         float kbps = (imageData->contentSize() / 1024.0f) / ((t2-t1) / 1000.0f);
         Serial.print("S"+String(t2-t1)+"ms "+String(kbps,1)+"kbps age "+String(t2 - imageData->timestamp()));
-        Serial.println(" Sent "+String(sentPackets)+"e"+String(errorPackets)+" free "+ESP.getFreeHeap());
+        Serial.println(" Sent "+String(sentPackets)+"e"+String(errorPackets)+"u"+String(unchangedFrames)+"c"+String(cutThroughPackets)+" "+HeapMonitor::toString());
         lastSentPacketsOut = sentPackets;
       }
     }
@@ -220,6 +423,21 @@ public:
   {
     return String(sentPackets);
   }
+
+  uint32_t getSentPackets()
+  {
+    return sentPackets;
+  }
+
+  uint32_t getErrorPackets()
+  {
+    return errorPackets;
+  }
+
+  const LinkQuality* getLinkQuality()
+  {
+    return &linkQuality;
+  }
 private:
   void finishPacket()
   {
@@ -240,38 +458,330 @@ private:
     }
 
     lastPacketMillis = millis();
+    control->noteTransmission();
+  }
+
+  uint32_t readUint32(uint8_t* source)
+  {
+    return (source[0] << 24) & 0xff000000 | (source[1] << 16) & 0xff0000 | (source[2] << 8) & 0xff00 | source[3] & 0xff;
+  }
+
+  uint64_t readUint64(uint8_t* source)
+  {
+    return ((uint64_t)readUint32(source) << 32) | readUint32(&source[4]);
+  }
+
+  bool isUnchanged(SyncedMemoryBuffer* imageData, uint32_t now)
+  {
+    return now - lastFullFrameMillis < UNCHANGED_REFRESH_MILLIS && isLikeLastSent(imageData);
+  }
+
+  bool isLikeLastSent(SyncedMemoryBuffer* imageData)
+  {
+    if (lastSentSize == 0) {
+      return false;
+    }
+
+    if (imageData->fingerprint() == lastSentFingerprint && imageData->contentSize() == lastSentSize) {
+      return true;
+    }
+
+    // not bit-identical (hardly ever with a real sensor): effectively identical?
+    if (imageData->profile().count() > 0) {
+      return imageData->profile().isSimilar(lastSentProfile, UNCHANGED_BAND_TOLERANCE);
+    }
+
+    uint32_t sizeDifference = imageData->contentSize() > lastSentSize ? imageData->contentSize() - lastSentSize : lastSentSize - imageData->contentSize();
+    return sizeDifference * 1000 < lastSentSize * UNCHANGED_SIZE_TOLERANCE;
+  }
+
+  /**
+   * Length of the JPEG segments from SOI up to and including the SOS header; 0 if not found.
+   */
+  static uint16_t jpegHeaderLength(const byte* content, uint32_t size)
+  {
+    if (size < 4 || content[0] != 0xff || content[1] != 0xd8) {
+      return 0;
+    }
+
+    uint32_t position = 2;
+    while (position + 4 <= size && position < JPEG_HEADER_MAX) {
+      if (content[position] != 0xff) {
+        return 0;
+      }
+
+      byte marker = content[position + 1];
+      uint16_t segmentLength = (content[position + 2] << 8) | content[position + 3];
+      position += 2 + segmentLength;
+
+      if (marker == 0xda) {
+        return position <= JPEG_HEADER_MAX && position < size ? position : 0;
+      }
+    }
+
+    return 0;
   }
 
-  void writePacket(uint16_t packetNumber, SyncedMemoryBuffer* imageData) 
+  /**
+   * Sends the packets of a frame the camera is still copying, as far as its bytes are valid.
+   * The last packet waits for release() (and the normal path): only then the size is certain.
+   */
+  void sendGrowingFrame(SyncedMemoryBuffer* growing)
   {
-    uint16_t packetCountTotal = ceil(imageData->contentSize() / (float) DATA_SIZE);
-    if (packetNumber >= packetCountTotal) {
-      Serial.println("!!!! Trying to write illegal packet of image data size "+String(packetNumber)+" vs "+String(imageData->contentSize()));
+    uint32_t timestamp = growing->growingTimestamp();
+    if (timestamp <= lastSentTimestamp) {
       return;
     }
-    
+
+    if (timestamp != streamingTimestamp) {
+      if (growing->validBytes() < JPEG_HEADER_MAX) {
+        return; // wait for the complete header
+      }
+
+      endStreaming();
+
+      growing->pin();
+      if (!growing->isGrowing() || growing->growingTimestamp() != timestamp) {
+        growing->unpin(); // the camera was faster
+        return;
+      }
+
+      streamingBuffer = growing;
+      streamingTimestamp = timestamp;
+      streamingNextPacket = 0;
+      uint32_t now = millis();
+      uint16_t headerLength = clientsKnowHeaders(now) ? updateHeader(growing->content(), growing->validBytes(), now) : 0;
+      planPackets(&streamingPlan, growing, timestamp, growing->growingSize(), headerLength, cachedHeaderId);
+      rememberPlan(timestamp, headerLength);
+    }
+
+    uint32_t headerLength = streamingPlan.payload - growing->content();
+    uint32_t packetEnd = headerLength + ImagePacket::dataOffset(streamingNextPacket + 1);
+    while (packetEnd <= growing->validBytes() && streamingNextPacket + 1 < streamingPlan.packetCount) {
+      writePacket(streamingNextPacket, &streamingPlan);
+      if (streamingNextPacket == 0) {
+        streamingFirstSent = micros();
+      }
+
+      streamingNextPacket++;
+      cutThroughPackets++;
+      packetEnd += DATA_SIZE;
+    }
+  }
+
+  void endStreaming()
+  {
+    if (streamingBuffer != NULL) {
+      streamingBuffer->unpin();
+      streamingBuffer = NULL;
+    }
+    streamingTimestamp = 0;
+  }
+
+  /**
+   * Caches the header of this frame and sends it if it is new or due; returns its length.
+   */
+  uint16_t updateHeader(byte* content, uint32_t size, uint32_t now)
+  {
+    uint16_t headerLength = jpegHeaderLength(content, size);
+    if (headerLength == 0) {
+      return 0;
+    }
+
+    if (headerLength != cachedHeaderLength || memcmp(cachedHeader, content, headerLength) != 0) {
+      memcpy(cachedHeader, content, headerLength);
+      cachedHeaderLength = headerLength;
+      cachedHeaderId++;
+      sendHeader();
+    } else if (now - lastHeaderSentMillis > JPEG_HEADER_REPEAT_MILLIS) {
+      sendHeader();
+    }
+
+    return headerLength;
+  }
+
+  /**
+   * Refreshes the client of this packet; a new one replaces the stalest.
+   */
+  void noteClient(IPAddress address, bool knowsHeaders, uint32_t now)
+  {
+    UdpClient* oldest = &clients[0];
+    for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+      if (clients[i].lastPacketMillis != 0 && clients[i].address == address) {
+        clients[i].lastPacketMillis = now;
+        clients[i].knowsHeaders |= knowsHeaders;
+        return;
+      }
+      if (now - clients[i].lastPacketMillis > now - oldest->lastPacketMillis) {
+        oldest = &clients[i];
+      }
+    }
+
+    oldest->address = address;
+    oldest->lastPacketMillis = now;
+    oldest->knowsHeaders = knowsHeaders;
+  }
+
+  /**
+   * 'RJ' only while every active client can splice headers; a silent older client is not noticed.
+   */
+  bool clientsKnowHeaders(uint32_t now)
+  {
+    bool any = false;
+    for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+      if (clients[i].lastPacketMillis == 0 || now - clients[i].lastPacketMillis > CLIENT_EXPIRE_MILLIS) {
+        continue;
+      }
+      if (!clients[i].knowsHeaders) {
+        return false;
+      }
+      any = true;
+    }
+
+    return any;
+  }
+
+  void rememberPlan(uint32_t timestamp, uint16_t headerLength)
+  {
+    SentPlan* sentPlan = sentPlanOf(timestamp);
+    if (sentPlan == NULL) {
+      sentPlan = &sentPlans[nextSentPlan];
+      nextSentPlan = (nextSentPlan + 1) % 2;
+    }
+
+    sentPlan->timestamp = timestamp;
+    sentPlan->headerLength = headerLength;
+    sentPlan->headerId = cachedHeaderId;
+  }
+
+  SentPlan* sentPlanOf(uint32_t timestamp)
+  {
+    for (uint8_t i = 0; i < 2; i++) {
+      if (sentPlans[i].timestamp == timestamp && timestamp != 0) {
+        return &sentPlans[i];
+      }
+    }
+
+    return NULL;
+  }
+
+  void sendHeader()
+  {
+    // between frames: the packet buffer is free
+    packetBuffer[0] = 'R';
+    packetBuffer[1] = 'H';
+    packetBuffer[2] = cachedHeaderId;
+    packetBuffer[3] = (byte)(cachedHeaderLength >> 8);
+    packetBuffer[4] = (byte)(cachedHeaderLength);
+    memcpy(&packetBuffer[5], cachedHeader, cachedHeaderLength);
+    sendPacket(&imageSender, broadcastAddress, udpPort, packetBuffer, 5 + cachedHeaderLength);
+
+    lastHeaderSentMillis = millis();
+  }
+
+  void writeUint32(byte* target, uint32_t value)
+  {
+    target[0] = (byte)(value >> 24);
+    target[1] = (byte)(value >> 16);
+    target[2] = (byte)(value >> 8);
+    target[3] = (byte)(value);
+  }
+
+  void writeUint64(byte* target, uint64_t value)
+  {
+    for (uint8_t i = 0; i < 8; i++) {
+      target[i] = (byte)(value >> (56 - 8 * i));
+    }
+  }
+
+  void sendControl(String answer)
+  {
+    String packet = "CT"+answer;
+    sendPacket(&controlSender, broadcastAddress, udpPort, (const byte*)packet.c_str(), packet.length());
+  }
+
+  /**
+   * Through the socket of the traffic class; WiFiUDP (best effort) if that could not be created.
+   */
+  void sendPacket(ZeroCopyUdpSender* sender, IPAddress address, uint16_t port, const byte* data, uint16_t size)
+  {
+    if (sender->isReady()) {
+      if (!sender->send(address, port, data, size, NULL, 0)) {
+        errorPackets++;
+      }
+      lastPacketMillis = millis();
+      control->noteTransmission();
+    } else {
+      beginPacket(address, port);
+      write(data, size);
+      finishPacket();
+    }
+  }
+
+  /**
+   * With a header length the packets are 'RJ': the data after the header with the id of that header.
+   */
+  void planPackets(PacketPlan* plan, SyncedMemoryBuffer* imageData, uint32_t timestamp, uint32_t contentSize, uint16_t headerLength, uint8_t headerId)
+  {
+    plan->payload = &(imageData->content())[headerLength];
+    plan->external = imageData->isExternal();
+    plan->payloadSize = contentSize - headerLength;
+    plan->packetCount = ImagePacket::packetCount(plan->payloadSize);
+    plan->headerSize = ImagePacket::headerSize(headerLength > 0);
+
+    byte* header = plan->header;
+    header[0] = 'R';
+    header[1] = headerLength > 0 ? 'J' : 'I';
+    header[2] = (byte)(timestamp >> 24);
+    header[3] = (byte)(timestamp >> 16);
+    header[4] = (byte)(timestamp >> 8);
+    header[5] = (byte)(timestamp);
+    header[8] = (byte)(plan->packetCount >> 8);
+    header[9] = (byte)(plan->packetCount);
+    header[10] = headerId;
+  }
+
+  void writePacket(uint16_t packetNumber, PacketPlan* plan) 
+  {
+    if (packetNumber >= plan->packetCount) {
+      Serial.println("!!!! Trying to write illegal packet of image data size "+String(packetNumber)+" vs "+String(plan->payloadSize));
+      return;
+    }
+
+    memcpy(packetBuffer, plan->header, plan->headerSize);
+    packetBuffer[ImagePacket::NUMBER_OFFSET] = (byte)(packetNumber >> 8);
+    packetBuffer[ImagePacket::NUMBER_OFFSET + 1] = (byte)(packetNumber);
+
+    uint16_t byteCount = ImagePacket::dataSize(packetNumber, plan->payloadSize);
+    byte* data = &plan->payload[ImagePacket::dataOffset(packetNumber)];
+
     // TODO use non-broadcast address?
-    
-    beginPacket("192.168.151.255", udpPort);
-    print("RI");
-
-    uint32_t timestamp = imageData->timestamp();
-    
-    write((byte)(timestamp >> 24));
-    write((byte)(timestamp >> 16));
-    write((byte)(timestamp >> 8));
-    write((byte)(timestamp));
-    write((byte)(packetNumber >> 8));
-    write((byte)(packetNumber));
-    write((byte)(packetCountTotal >> 8));
-    write((byte)(packetCountTotal));
-
-    uint32_t byteStart = packetNumber * DATA_SIZE;
-    uint16_t byteCount = _min(imageData->contentSize() - byteStart + 1, DATA_SIZE);
-    byte* bufferPointer = &((imageData->content())[byteStart]);
-    write(bufferPointer, byteCount);
-
-    finishPacket();
+    if (imageSender.isReady()) {
+      if (plan->external) {
+        // one sequential read from PSRAM; the WiFi driver cannot use it directly anyway
+        memcpy(&packetBuffer[plan->headerSize], data, byteCount);
+        data = &packetBuffer[plan->headerSize];
+        copiedBytes += byteCount;
+      }
+
+      // NOTE the frame buffer is held (or pinned) by the caller until this returns
+      if (!imageSender.send(broadcastAddress, udpPort, packetBuffer, plan->headerSize, data, byteCount)) {
+        errorPackets++;
+      }
+      lastPacketMillis = millis();
+      control->noteTransmission();
+
+      // the header into its pbuf, then the driver makes one transmit buffer of the chain
+      copiedBytes += plan->headerSize + plan->headerSize + byteCount;
+    } else {
+      memcpy(&packetBuffer[plan->headerSize], data, byteCount);
+      beginPacket(broadcastAddress, udpPort);
+      write(packetBuffer, plan->headerSize + byteCount);
+      finishPacket();
+
+      // here, into WiFiUDP and into a single pbuf (the driver then takes that as it is)
+      copiedBytes += 3 * (plan->headerSize + byteCount);
+    }
   
     sentPackets++;
   }
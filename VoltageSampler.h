@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __VOLTAGE_SAMPLER_H__
+#define __VOLTAGE_SAMPLER_H__
+
+#include "Task.h"
+
+/**
+ * Reads the battery voltage in its own (low priority) task and keeps a filtered value
+ * that can be read at any time without touching the ADC.
+ */
+class VoltageSampler : public Task
+{
+private:
+  static const uint8_t SAMPLES_PER_READING = 9;
+  const uint16_t QUIET_MILLIS = 190; // only then stable voltage readings are possible
+  const uint16_t SAMPLE_INTERVAL_MILLIS = 50;
+  const uint16_t MAX_AGE_MILLIS = 2000; // while streaming there is never a quiet time; a disturbed reading is better than a stale one
+  const float FILTER_FACTOR = 0.2f; // weight of a new reading
+
+  uint8_t voltagePin;
+  
+  volatile uint32_t lastTransmissionMillis = 0;
+  volatile uint32_t lastReadingMillis = 0;
+  volatile float filteredRaw = 0;
+  volatile float voltage = 0;
+
+public:
+  void setup(uint8_t pin)
+  {
+    voltagePin = pin;
+    
+    // TODO adcAttachPin()? pinMode(,INPUT)?
+
+    // NOTE using anything other than 10 bit and 0 db leads to radically worse values
+    analogReadResolution(10); // now range is 0..1023
+    analogSetPinAttenuation(voltagePin, ADC_0db); // metering range 1.1 volts
+  }
+
+  virtual void run()
+  {
+    while (true) {
+      uint32_t loopStart = millis();
+
+      if (loopStart - lastTransmissionMillis > QUIET_MILLIS || readingAge() > MAX_AGE_MILLIS) {
+        sample();
+      }
+
+      sleepAfterLoop(SAMPLE_INTERVAL_MILLIS, loopStart);
+    }
+  }
+
+  /**
+   * To be called by senders; radio transmission disturbs the readings.
+   */
+  void noteTransmission()
+  {
+    lastTransmissionMillis = millis();
+  }
+
+  float currentVoltage()
+  {
+    return voltage;
+  }
+
+  uint16_t currentRaw()
+  {
+    return round(filteredRaw);
+  }
+
+  bool hasReading()
+  {
+    return lastReadingMillis != 0;
+  }
+
+  /**
+   * Millis since the last reading; the values above are that old.
+   */
+  uint32_t readingAge()
+  {
+    return hasReading() ? millis() - lastReadingMillis : UINT32_MAX;
+  }
+
+private:
+  void sample()
+  {
+    uint16_t samples[SAMPLES_PER_READING];
+    for (uint8_t i = 0; i < SAMPLES_PER_READING; i++) {
+      samples[i] = analogRead(voltagePin);
+    }
+
+    // insertion sort for the median; only a few values
+    for (uint8_t i = 1; i < SAMPLES_PER_READING; i++) {
+      uint16_t value = samples[i];
+      int8_t j = i - 1;
+      while (j >= 0 && samples[j] > value) {
+        samples[j + 1] = samples[j];
+        j--;
+      }
+      samples[j + 1] = value;
+    }
+    uint16_t median = samples[SAMPLES_PER_READING / 2];
+
+    float newRaw = lastReadingMillis == 0 ? median : filteredRaw + FILTER_FACTOR * (median - filteredRaw);
+    
+    float bridgeFactor = (370.0f + 82) / 82;//(384.0f + 81) / 81; // another board (266.0f + 80) / 80;
+    float refVoltage = 1.1f;
+    float maxValue = 1023.0f;
+    float measureVoltage = newRaw / maxValue * refVoltage;
+
+    // 4.2 volts then corresponds to 0.97 volts measured
+
+    filteredRaw = newRaw;
+    voltage = measureVoltage * bridgeFactor;
+    lastReadingMillis = millis();
+  }
+};
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WIFI_LINK_SETTINGS_H__
+#define __WIFI_LINK_SETTINGS_H__
+
+#include <esp_wifi.h>
+#include <esp_wifi_internal.h>
+
+/**
+ * 802.11 protocol, bandwidth, PHY rate and TX power of the AP.
+ *
+ * Broadcasts (the image packets) are not acknowledged, so the driver sends them at the lowest basic
+ * rate (1Mbps with 11b enabled). The driver can only fix the rate of all frames of the AP, unicast
+ * included: that turns off rate adaptation. So "auto" is the default and a fixed rate is for trying
+ * out at a known distance.
+ *
+ * Changeable at runtime with the control command "link [proto b|bg|bgn] [bw 20|40] [rate auto|1m..54m|mcs0..mcs7[s]] [power dBm]";
+ * "link" alone reports the current settings.
+ */
+class WifiLinkSettings
+{
+private:
+  struct Rate
+  {
+    const char* name;
+    wifi_phy_rate_t rate;
+  };
+
+  static const Rate* rates(uint8_t* count)
+  {
+    static const Rate RATES[] = {
+      { "1m", WIFI_PHY_RATE_1M_L }, { "2m", WIFI_PHY_RATE_2M_S }, { "5m", WIFI_PHY_RATE_5M_S }, { "11m", WIFI_PHY_RATE_11M_S },
+      { "6m", WIFI_PHY_RATE_6M }, { "9m", WIFI_PHY_RATE_9M }, { "12m", WIFI_PHY_RATE_12M }, { "18m", WIFI_PHY_RATE_18M },
+      { "24m", WIFI_PHY_RATE_24M }, { "36m", WIFI_PHY_RATE_36M }, { "48m", WIFI_PHY_RATE_48M }, { "54m", WIFI_PHY_RATE_54M },
+      { "mcs0", WIFI_PHY_RATE_MCS0_LGI }, { "mcs1", WIFI_PHY_RATE_MCS1_LGI }, { "mcs2", WIFI_PHY_RATE_MCS2_LGI }, { "mcs3", WIFI_PHY_RATE_MCS3_LGI },
+      { "mcs4", WIFI_PHY_RATE_MCS4_LGI }, { "mcs5", WIFI_PHY_RATE_MCS5_LGI }, { "mcs6", WIFI_PHY_RATE_MCS6_LGI }, { "mcs7", WIFI_PHY_RATE_MCS7_LGI },
+      { "mcs0s", WIFI_PHY_RATE_MCS0_SGI }, { "mcs1s", WIFI_PHY_RATE_MCS1_SGI }, { "mcs2s", WIFI_PHY_RATE_MCS2_SGI }, { "mcs3s", WIFI_PHY_RATE_MCS3_SGI },
+      { "mcs4s", WIFI_PHY_RATE_MCS4_SGI }, { "mcs5s", WIFI_PHY_RATE_MCS5_SGI }, { "mcs6s", WIFI_PHY_RATE_MCS6_SGI }, { "mcs7s", WIFI_PHY_RATE_MCS7_SGI },
+    };
+    *count = sizeof(RATES) / sizeof(RATES[0]);
+    return RATES;
+  }
+
+  static const int8_t RATE_AUTO = -1;
+  static const int8_t MIN_POWER = 8; // in 0.25dBm
+  static const int8_t MAX_POWER = 78;
+
+  uint8_t protocol = WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N;
+  wifi_bandwidth_t bandwidth = WIFI_BW_HT20;
+  int8_t rateIndex = RATE_AUTO;
+  int8_t power = MAX_POWER;
+  String lastError = "";
+
+public:
+  /**
+   * Settings for the next apply(); same syntax as the control command (without "link").
+   * @return false if something was not understood (the rest is still taken)
+   */
+  bool configure(String settings)
+  {
+    lastError = "";
+
+    settings.trim();
+    while (settings.length() > 0) {
+      int idx = settings.indexOf(' ');
+      String key = settings.substring(0, idx);
+      String rest = idx < 0 ? "" : settings.substring(idx + 1);
+      idx = rest.indexOf(' ');
+      String value = rest.substring(0, idx < 0 ? rest.length() : idx);
+      settings = idx < 0 ? "" : rest.substring(idx + 1);
+      settings.trim();
+
+      if (!configure(key, value)) {
+        lastError += " bad "+key+"="+value;
+      }
+    }
+
+    return lastError.length() == 0;
+  }
+
+  /**
+   * Needs a started AP.
+   */
+  bool apply()
+  {
+    uint8_t rateCount;
+    const Rate* rateTable = rates(&rateCount);
+    if (bandwidth == WIFI_BW_HT40 && (protocol & WIFI_PROTOCOL_11N) == 0) {
+      lastError += " ht40 needs n";
+      bandwidth = WIFI_BW_HT20;
+    }
+    if (rateIndex != RATE_AUTO && isHtRate(rateTable[rateIndex].rate) && (protocol & WIFI_PROTOCOL_11N) == 0) {
+      lastError += " "+String(rateTable[rateIndex].name)+" needs n";
+      rateIndex = RATE_AUTO;
+    }
+
+    check("proto", esp_wifi_set_protocol(WIFI_IF_AP, protocol));
+    check("bw", esp_wifi_set_bandwidth(WIFI_IF_AP, bandwidth));
+    if (rateIndex == RATE_AUTO) {
+      check("rate", esp_wifi_internal_set_fix_rate(WIFI_IF_AP, false, WIFI_PHY_RATE_1M_L));
+    } else {
+      check("rate", esp_wifi_internal_set_fix_rate(WIFI_IF_AP, true, rateTable[rateIndex].rate));
+    }
+    check("power", esp_wifi_set_max_tx_power(power));
+
+    return lastError.length() == 0;
+  }
+
+  bool supports(String requested)
+  {
+    return requested.startsWith("link");
+  }
+
+  String handle(String requested)
+  {
+    lastError = "";
+    if (requested.length() > 5) {
+      configure(requested.substring(5));
+      apply();
+    }
+
+    return "LINK "+toString()+(lastError.length() > 0 ? " err"+lastError : "");
+  }
+
+  String toString()
+  {
+    uint8_t rateCount;
+    const Rate* rateTable = rates(&rateCount);
+
+    // what the driver has; ie not all protocols are possible with every client
+    uint8_t currentProtocol = 0;
+    wifi_bandwidth_t currentBandwidth = WIFI_BW_HT20;
+    int8_t currentPower = 0;
+    esp_wifi_get_protocol(WIFI_IF_AP, &currentProtocol);
+    esp_wifi_get_bandwidth(WIFI_IF_AP, &currentBandwidth);
+    esp_wifi_get_max_tx_power(&currentPower);
+
+    return "proto "+protocolName(currentProtocol)+" bw "+String(currentBandwidth == WIFI_BW_HT40 ? 40 : 20)
+      +" rate "+String(rateIndex == RATE_AUTO ? "auto" : rateTable[rateIndex].name)+" power "+String(currentPower / 4.0f, 2);
+  }
+
+private:
+  bool configure(String key, String value)
+  {
+    if (key == "proto") {
+      uint8_t newProtocol = 0;
+      for (uint8_t i = 0; i < value.length(); i++) {
+        char p = value.charAt(i);
+        newProtocol |= p == 'b' ? WIFI_PROTOCOL_11B : (p == 'g' ? WIFI_PROTOCOL_11G : (p == 'n' ? WIFI_PROTOCOL_11N : 0xff));
+      }
+      // the driver knows only these combinations
+      if (newProtocol != WIFI_PROTOCOL_11B && newProtocol != (WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G)
+          && newProtocol != (WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N)) {
+        return false;
+      }
+      protocol = newProtocol;
+    } else if (key == "bw") {
+      if (value != "20" && value != "40") {
+        return false;
+      }
+      bandwidth = value == "40" ? WIFI_BW_HT40 : WIFI_BW_HT20;
+    } else if (key == "rate") {
+      if (value == "auto") {
+        rateIndex = RATE_AUTO;
+        return true;
+      }
+
+      uint8_t rateCount;
+      const Rate* rateTable = rates(&rateCount);
+      for (uint8_t i = 0; i < rateCount; i++) {
+        if (value == rateTable[i].name) {
+          rateIndex = i;
+          return true;
+        }
+      }
+      return false;
+    } else if (key == "power") {
+      int32_t quarters = (int32_t)(value.toFloat() * 4 + 0.5f);
+      if (quarters < MIN_POWER || quarters > MAX_POWER) {
+        return false;
+      }
+      power = quarters;
+    } else {
+      return false;
+    }
+
+    return true;
+  }
+
+  void check(const char* what, esp_err_t result)
+  {
+    if (result != ESP_OK) {
+      lastError += " "+String(what)+" "+String((int)result);
+    }
+  }
+
+  static bool isHtRate(wifi_phy_rate_t rate)
+  {
+    return rate >= WIFI_PHY_RATE_MCS0_LGI;
+  }
+
+  static String protocolName(uint8_t p)
+  {
+    return String((p & WIFI_PROTOCOL_11B) ? "b" : "")+String((p & WIFI_PROTOCOL_11G) ? "g" : "")+String((p & WIFI_PROTOCOL_11N) ? "n" : "");
+  }
+};
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ZERO_COPY_UDP_SENDER_H__
+#define __ZERO_COPY_UDP_SENDER_H__
+
+#include <lwip/api.h>
+
+/**
+ * Sends UDP packets with the netconn API: a small copied header pbuf chained to a PBUF_REF
+ * pointing directly into the payload (ie a frame buffer).
+ * WiFiUDP instead copies every byte into its own buffer and then again into a pbuf.
+ *
+ * NOTE the payload must not change until send() returns: then lwIP is done with the reference
+ * (the WiFi driver copies chained pbufs into one transmit buffer).
+ * NOTE bound to the port of the WiFiUDP socket, so clients see one source port for everything.
+ * lwIP hands a received packet to the pcb bound last: begin() must come before WiFiUDP::begin()
+ * to leave receiving with WiFiUDP. Whatever still arrives here is discarded with discardReceived().
+ * With a TOS all packets of the sender get that DSCP: the WiFi driver puts them into the WMM queue
+ * of its access category.
+ */
+class ZeroCopyUdpSender
+{
+private:
+  struct netconn* connection = NULL;
+
+public:
+  bool begin(uint16_t localPort, uint8_t tos = 0)
+  {
+    connection = netconn_new(NETCONN_UDP);
+    if (connection == NULL) {
+      return false;
+    }
+
+    ip_set_option(connection->pcb.udp, SOF_BROADCAST);
+    // shares the port with WiFiUDP (which also sets SO_REUSEADDR)
+    ip_set_option(connection->pcb.udp, SOF_REUSEADDR);
+    if (netconn_bind(connection, IP_ADDR_ANY, localPort) != ERR_OK) {
+      netconn_delete(connection);
+      connection = NULL;
+      return false;
+    }
+    netconn_set_nonblocking(connection, 1);
+    connection->pcb.udp->tos = tos;
+    return true;
+  }
+
+  /**
+   * Frees packets delivered to this pcb too (ie broadcasts with SO_REUSE_RXTOALL).
+   */
+  void discardReceived()
+  {
+    if (connection == NULL) {
+      return;
+    }
+
+    struct netbuf* received = NULL;
+    while (netconn_recv(connection, &received) == ERR_OK) {
+      netbuf_delete(received);
+    }
+  }
+
+  bool isReady()
+  {
+    return connection != NULL;
+  }
+
+  bool send(IPAddress address, uint16_t port, const byte* header, uint16_t headerSize, const byte* data, uint16_t dataSize)
+  {
+    ip_addr_t destination;
+    IP_ADDR4(&destination, address[0], address[1], address[2], address[3]);
+
+    err_t result = ERR_MEM;
+    int retryCounter = 0;
+    do {
+      if (retryCounter > 0) {
+        delayMicroseconds(500);
+      }
+      result = sendOnce(&destination, port, header, headerSize, data, dataSize);
+    } while (result == ERR_MEM && ++retryCounter <= 30);
+
+    return result == ERR_OK;
+  }
+
+private:
+  err_t sendOnce(ip_addr_t* destination, uint16_t port, const byte* header, uint16_t headerSize, const byte* data, uint16_t dataSize)
+  {
+    if (dataSize == 0) {
+      return sendCopy(destination, port, header, headerSize);
+    }
+
+    struct netbuf* packet = netbuf_new();
+    struct netbuf* payload = netbuf_new();
+    if (packet == NULL || payload == NULL) {
+      netbuf_delete(packet);
+      netbuf_delete(payload);
+      return ERR_MEM;
+    }
+
+    void* headerCopy = netbuf_alloc(packet, headerSize);
+    if (headerCopy == NULL || netbuf_ref(payload, data, dataSize) != ERR_OK) {
+      netbuf_delete(packet);
+      netbuf_delete(payload);
+      return ERR_MEM;
+    }
+    memcpy(headerCopy, header, headerSize);
+
+    netbuf_chain(packet, payload); // also frees the payload netbuf (not the pbuf)
+
+    err_t result = netconn_sendto(connection, packet, destination, port);
+    netbuf_delete(packet);
+
+    return result;
+  }
+
+  /**
+   * Small packets (ie control answers) in one copied pbuf.
+   */
+  err_t sendCopy(ip_addr_t* destination, uint16_t port, const byte* data, uint16_t size)
+  {
+    struct netbuf* packet = netbuf_new();
+    if (packet == NULL) {
+      return ERR_MEM;
+    }
+
+    void* copy = netbuf_alloc(packet, size);
+    if (copy == NULL) {
+      netbuf_delete(packet);
+      return ERR_MEM;
+    }
+    memcpy(copy, data, size);
+
+    err_t result = netconn_sendto(connection, packet, destination, port);
+    netbuf_delete(packet);
+
+    return result;
+  }
+};
+
+#endif
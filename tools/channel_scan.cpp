@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Runs the ChannelSelector of the rover on recorded scan results on Linux.
+ *
+ * A recording has one network per line: "channel rssi [ssid]" ('#' starts a comment).
+ * The "W channel rssi" lines the rover prints at startup can be pasted as they are.
+ * Without a file the built-in recordings are checked against the channel they should yield.
+ *
+ * Build: g++ -O2 -std=c++11 -I. -o channel_scan tools/channel_scan.cpp
+ * Run:   ./channel_scan [recording file] [highest channel]
+ *        (on Linux a recording can be made with: nmcli -t -f CHAN,SIGNAL dev wifi; SIGNAL/2-100 is the rssi)
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "ChannelSelector.h"
+
+struct Recording
+{
+  const char* name;
+  const char* networks;
+  uint8_t expectedChannel;
+};
+
+static const Recording recordings[] = {
+  { "empty air", "", 1 },
+  { "one strong neighbour on 1", "1 -40", 6 },
+  { "typical flat (1, 6 and 11 busy)", "1 -70\n1 -82\n6 -55\n6 -60\n6 -88\n11 -75\n11 -79\n11 -90", 1 },
+  { "strong 6 and weak 1", "1 -90\n6 -35\n6 -45", 11 },
+  { "many faint and one loud", "1 -92\n1 -93\n1 -94\n1 -95\n11 -45", 6 },
+  { "many faint beat one loud", "1 -94\n1 -95\n1 -96\n1 -97\n6 -45\n11 -45", 1 },
+  { "gap between non-overlapping ones", "1 -50\n6 -50\n11 -50\n3 -60\n9 -60", 1 },
+  { "5GHz and garbage ignored", "36 -30\n0 -30\n14 -30", 1 },
+};
+
+static void parse(ChannelSelector& selector, const char* text)
+{
+  const char* line = text;
+  while (*line != '\0') {
+    const char* end = strchr(line, '\n');
+    size_t length = end == NULL ? strlen(line) : end - line;
+
+    char buffer[128];
+    length = length < sizeof(buffer) - 1 ? length : sizeof(buffer) - 1;
+    memcpy(buffer, line, length);
+    buffer[length] = '\0';
+
+    const char* values = buffer[0] == 'W' ? buffer + 1 : buffer;
+    int channel = 0;
+    int rssi = 0;
+    if (buffer[0] != '#' && sscanf(values, "%d %d", &channel, &rssi) == 2) {
+      selector.addNetwork(channel, rssi);
+    }
+
+    line = end == NULL ? line + length : end + 1;
+  }
+}
+
+static void print(const ChannelSelector& selector, uint8_t highest)
+{
+  for (uint8_t c = 1; c <= highest; c++) {
+    printf("%2d: %3d networks score %6u\n", c, selector.networkCount(c), selector.score(c));
+  }
+  printf("best %d\n", selector.bestChannel());
+}
+
+static int checkRecordings()
+{
+  int failures = 0;
+  for (size_t i = 0; i < sizeof(recordings) / sizeof(recordings[0]); i++) {
+    ChannelSelector selector;
+    parse(selector, recordings[i].networks);
+    uint8_t best = selector.bestChannel();
+    bool good = best == recordings[i].expectedChannel;
+    printf("%s %s: %d", good ? "ok  " : "FAIL", recordings[i].name, best);
+    if (!good) {
+      printf(" (expected %d)", recordings[i].expectedChannel);
+      failures++;
+    }
+    printf("\n");
+  }
+
+  // no switch for small improvements
+  ChannelSelector selector;
+  parse(selector, "1 -40\n6 -58\n11 -62");
+  bool good = !selector.isWorthSwitching(6) && selector.isWorthSwitching(1) && !selector.isWorthSwitching(11);
+  printf("%s switch hysteresis\n", good ? "ok  " : "FAIL");
+  if (!good) {
+    failures++;
+  }
+
+  return failures;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    int failures = checkRecordings();
+    printf("%d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+  }
+
+  FILE* file = fopen(argv[1], "r");
+  if (file == NULL) {
+    fprintf(stderr, "Cannot open %s\n", argv[1]);
+    return 2;
+  }
+
+  static char text[1 << 16];
+  size_t length = fread(text, 1, sizeof(text) - 1, file);
+  text[length] = '\0';
+  fclose(file);
+
+  uint8_t highest = argc > 2 ? atoi(argv[2]) : 11;
+  ChannelSelector selector(highest);
+  parse(selector, text);
+  print(selector, highest);
+
+  return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Checks the frame buffers in (emulated, slower) PSRAM on Linux: the fallback when there is too
+ * little of it, frame content after the chunked copy through an internal buffer, and the copy times.
+ *
+ * Build: g++ -O2 -std=c++11 -Itools/host -I. -include Arduino.h -o external_memory_check tools/external_memory_check.cpp -lpthread
+ * Run:   ./external_memory_check [PSRAM MB/s, default 20]
+ */
+
+#include "FrameWriter.h"
+
+static int failures = 0;
+
+static void check(bool good, const char* what)
+{
+  printf("%s %s\n", good ? "ok  " : "FAIL", what);
+  if (!good) {
+    failures++;
+  }
+}
+
+/**
+ * Like AsyncArducam, with the camera FIFO read by memcpy.
+ * @return micros
+ */
+static uint32_t copyFrame(SyncedMemoryBuffer* buffer, const byte* camera, uint32_t size)
+{
+  static FrameWriter writer;
+  uint32_t start = micros();
+
+  buffer->take("cam");
+  writer.begin(buffer, size, millis());
+  for (uint32_t copied = 0; !writer.isDone(); ) {
+    uint16_t length = writer.chunkSize();
+    memcpy(writer.chunk(), &camera[copied], length);
+    writer.commit();
+    copied += length;
+  }
+  writer.finish(millis());
+
+  return micros() - start;
+}
+
+int main(int argc, char** argv)
+{
+  uint32_t megabytesPerSecond = argc > 1 ? atoi(argv[1]) : 20;
+  HostExternalMemory& memory = hostExternalMemory();
+
+  // too little PSRAM for two buffers: neither is external and nothing stays allocated
+  memory.size = EXTERNAL_BUFFER_SIZE * 3 / 2;
+  SyncedMemoryBuffer one;
+  SyncedMemoryBuffer other;
+  bool external = SyncedMemoryBuffer::setupExternal(&one, &other, EXTERNAL_BUFFER_SIZE);
+  check(!external && memory.used == 0, "too little PSRAM: no external buffer");
+  if (!external) {
+    one.setup();
+    other.setup();
+  }
+  check(!one.isExternal() && !other.isExternal() && one.maxSize() == BUFFER_SIZE, "fallback to internal buffers");
+
+  memory.size = 4 * 1024 * 1024;
+  SyncedMemoryBuffer externalOne;
+  SyncedMemoryBuffer externalOther;
+  external = SyncedMemoryBuffer::setupExternal(&externalOne, &externalOther, EXTERNAL_BUFFER_SIZE);
+  check(external && externalOne.isExternal() && externalOther.isExternal() && memory.used == 2 * EXTERNAL_BUFFER_SIZE,
+    "both buffers in PSRAM");
+  check(externalOne.maxSize() == EXTERNAL_BUFFER_SIZE && externalOne.content() != externalOther.content(), "separate full size buffers");
+  if (!external) {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+
+  static byte camera[EXTERNAL_BUFFER_SIZE];
+  for (uint32_t i = 0; i < sizeof(camera); i++) {
+    camera[i] = random(256);
+  }
+
+  // a 1600x1200 frame into PSRAM, an 800x600 one into internal RAM
+  memory.megabytesPerSecond = megabytesPerSecond;
+  uint32_t externalMicros = copyFrame(&externalOne, camera, EXTERNAL_BUFFER_SIZE);
+  check(externalOne.contentSize() == EXTERNAL_BUFFER_SIZE && memcmp(externalOne.content(), camera, EXTERNAL_BUFFER_SIZE) == 0
+    && externalOne.fingerprint() == SyncedMemoryBuffer::hashContent(0, camera, EXTERNAL_BUFFER_SIZE), "external frame content");
+
+  uint32_t internalMicros = copyFrame(&one, camera, BUFFER_SIZE);
+  check(memcmp(one.content(), camera, BUFFER_SIZE) == 0
+    && one.fingerprint() == SyncedMemoryBuffer::hashContent(0, camera, BUFFER_SIZE), "internal frame content");
+
+  uint32_t expectedMicros = EXTERNAL_BUFFER_SIZE / megabytesPerSecond;
+  printf("     external %u us (expected %u us for %u MB/s), internal %u us\n", externalMicros, expectedMicros, megabytesPerSecond, internalMicros);
+  check(externalMicros >= expectedMicros && externalMicros < expectedMicros * 3 / 2, "external copy at PSRAM speed");
+  check(internalMicros < BUFFER_SIZE / megabytesPerSecond, "internal copy not slowed down");
+
+  // sending reads the frame once more (into the packet buffer); both must fit into a frame period
+  uint32_t readStart = micros();
+  static byte packet[1200];
+  for (uint32_t position = 0; position < EXTERNAL_BUFFER_SIZE; position += sizeof(packet)) {
+    memcpy(packet, &(externalOne.content())[position], _min(sizeof(packet), EXTERNAL_BUFFER_SIZE - position));
+  }
+  uint32_t readMicros = micros() - readStart;
+  printf("     copy and send reads %u us per 1600x1200 frame\n", externalMicros + readMicros);
+  check(externalMicros + readMicros < 200000, "a frame in PSRAM fits into 5 fps");
+
+  printf("%d failures\n", failures);
+  return failures == 0 ? 0 : 1;
+}
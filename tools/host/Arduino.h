@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Minimal stand-in for the Arduino/ESP32/FreeRTOS environment so that the rover headers
+ * (i.e. UdpImageServer.h) can be built and run on Linux. Only what the rover code uses.
+ */
+
+#ifndef __HOST_ARDUINO_H__
+#define __HOST_ARDUINO_H__
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+typedef uint8_t byte;
+
+#define _min(a, b) ((a) < (b) ? (a) : (b))
+#define _max(a, b) ((a) > (b) ? (a) : (b))
+
+#define IRAM_ATTR
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0x01
+#define OUTPUT 0x02
+#define INPUT_PULLUP 0x05
+#define FALLING 0x02
+#define ADC_0db 0
+
+class String
+{
+private:
+  std::string text;
+
+public:
+  String() {}
+  String(const char* value) : text(value != NULL ? value : "") {}
+  String(const std::string& value) : text(value) {}
+  explicit String(char value) : text(1, value) {}
+  String(int value) : text(std::to_string(value)) {}
+  String(unsigned int value) : text(std::to_string(value)) {}
+  String(long value) : text(std::to_string(value)) {}
+  String(unsigned long value) : text(std::to_string(value)) {}
+  String(long long value) : text(std::to_string(value)) {}
+  String(unsigned long long value) : text(std::to_string(value)) {}
+  String(float value, unsigned char decimals = 2) : String((double)value, decimals) {}
+  String(double value, unsigned char decimals = 2)
+  {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+    text = buffer;
+  }
+
+  String& operator+=(const String& other) { text += other.text; return *this; }
+  String& operator+=(const char* other) { text += other; return *this; }
+  String& operator+=(char other) { text += other; return *this; }
+
+  friend String operator+(const String& a, const String& b) { return String(a.text + b.text); }
+  friend String operator+(const String& a, const char* b) { return String(a.text + b); }
+  friend String operator+(const char* a, const String& b) { return String(a + b.text); }
+
+  bool operator==(const String& other) const { return text == other.text; }
+  bool operator!=(const String& other) const { return text != other.text; }
+  bool operator==(const char* other) const { return text == other; }
+  bool operator!=(const char* other) const { return text != other; }
+  char operator[](unsigned int index) const { return index < text.size() ? text[index] : 0; }
+
+  unsigned int length() const { return text.size(); }
+  const char* c_str() const { return text.c_str(); }
+  char charAt(unsigned int index) const { return (*this)[index]; }
+  bool startsWith(const String& prefix) const { return text.compare(0, prefix.text.size(), prefix.text) == 0; }
+  bool endsWith(const String& suffix) const
+  {
+    return text.size() >= suffix.text.size() && text.compare(text.size() - suffix.text.size(), suffix.text.size(), suffix.text) == 0;
+  }
+  String substring(unsigned int from) const { return from < text.size() ? String(text.substr(from)) : String(); }
+  String substring(unsigned int from, unsigned int to) const
+  {
+    return from < text.size() && to > from ? String(text.substr(from, to - from)) : String();
+  }
+  int indexOf(char c, unsigned int from = 0) const
+  {
+    size_t found = text.find(c, from);
+    return found == std::string::npos ? -1 : (int)found;
+  }
+  int indexOf(const String& other, unsigned int from = 0) const
+  {
+    size_t found = text.find(other.text, from);
+    return found == std::string::npos ? -1 : (int)found;
+  }
+  long toInt() const { return atol(text.c_str()); }
+  float toFloat() const { return atof(text.c_str()); }
+  void trim()
+  {
+    size_t start = text.find_first_not_of(" \t\r\n");
+    size_t end = text.find_last_not_of(" \t\r\n");
+    text = start == std::string::npos ? "" : text.substr(start, end - start + 1);
+  }
+};
+
+class HostSerial
+{
+public:
+  void begin(unsigned long) {}
+  void print(const String& value) { fputs(value.c_str(), stdout); }
+  void println(const String& value) { puts(value.c_str()); }
+  void println() { puts(""); }
+  void flush() { fflush(stdout); }
+};
+
+static HostSerial Serial;
+
+inline std::chrono::steady_clock::time_point hostStartTime()
+{
+  static std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  return start;
+}
+
+inline int64_t esp_timer_get_time()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - hostStartTime()).count();
+}
+
+inline uint32_t micros() { return (uint32_t)esp_timer_get_time(); }
+inline uint32_t millis() { return (uint32_t)(esp_timer_get_time() / 1000); }
+inline void delay(uint32_t ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+inline void delayMicroseconds(uint32_t us) { std::this_thread::sleep_for(std::chrono::microseconds(us)); }
+inline void yield() { std::this_thread::yield(); }
+inline long random(long max) { return max > 0 ? rand() % max : 0; }
+
+// Hardware: nothing there
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t, uint8_t) {}
+inline int digitalRead(uint8_t) { return LOW; }
+inline uint16_t analogRead(uint8_t) { return 800; }
+inline void analogReadResolution(uint8_t) {}
+inline void analogSetPinAttenuation(uint8_t, int) {}
+inline double ledcSetup(uint8_t, double frequency, uint8_t) { return frequency; }
+inline void ledcAttachPin(uint8_t, uint8_t) {}
+inline void ledcWrite(uint8_t, uint32_t) {}
+// the last tone per channel: motor checks see the step frequencies
+inline double* hostLedcTones() { static double tones[16]; return tones; }
+inline double ledcWriteTone(uint8_t channel, double frequency) { hostLedcTones()[channel % 16] = frequency; return frequency; }
+
+class HostEsp
+{
+public:
+  uint32_t getFreeHeap() { return 100000; }
+};
+
+static HostEsp ESP;
+
+// FreeRTOS: tasks are threads, semaphores are mutexes, one tick is one millisecond
+
+typedef void* TaskHandle_t;
+typedef TaskHandle_t xTaskHandle;
+typedef std::timed_mutex* SemaphoreHandle_t;
+typedef uint32_t TickType_t;
+typedef unsigned int UBaseType_t;
+typedef int BaseType_t;
+typedef uint8_t StackType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portTICK_PERIOD_MS 1
+#define portMAX_DELAY 0xffffffff
+#define pdMS_TO_TICKS(ms) (ms)
+#define taskYIELD() std::this_thread::yield()
+
+/** The handle of the task running in this thread */
+inline TaskHandle_t& hostCurrentTask()
+{
+  static thread_local TaskHandle_t current = NULL;
+  return current;
+}
+
+inline BaseType_t xTaskCreate(void (*function)(void*), const char*, uint32_t, void* parameter, UBaseType_t, TaskHandle_t* handle)
+{
+  std::thread([function, parameter]() {
+    hostCurrentTask() = parameter;
+    function(parameter);
+  }).detach();
+  if (handle != NULL) {
+    *handle = parameter;
+  }
+  return pdPASS;
+}
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return hostCurrentTask(); }
+inline void vTaskDelete(TaskHandle_t) {}
+inline void vTaskDelay(TickType_t ticks) { delay(ticks); }
+inline TickType_t xTaskGetTickCount() { return millis(); }
+
+inline void vTaskDelayUntil(TickType_t* previousWake, TickType_t increment)
+{
+  *previousWake += increment;
+  int32_t wait = *previousWake - xTaskGetTickCount();
+  if (wait > 0) {
+    delay(wait);
+  }
+}
+
+struct HostNotification
+{
+  std::mutex mutex;
+  std::condition_variable condition;
+  uint32_t count = 0;
+};
+
+inline HostNotification& hostNotification(TaskHandle_t task)
+{
+  static std::mutex allMutex;
+  static std::map<TaskHandle_t, HostNotification*> all;
+  std::lock_guard<std::mutex> lock(allMutex);
+  HostNotification*& notification = all[task];
+  if (notification == NULL) {
+    notification = new HostNotification();
+  }
+  return *notification;
+}
+
+inline void xTaskNotifyGive(TaskHandle_t task)
+{
+  HostNotification& notification = hostNotification(task);
+  std::lock_guard<std::mutex> lock(notification.mutex);
+  notification.count++;
+  notification.condition.notify_one();
+}
+
+inline uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks)
+{
+  HostNotification& notification = hostNotification(hostCurrentTask());
+  std::unique_lock<std::mutex> lock(notification.mutex);
+  if (ticks == portMAX_DELAY) {
+    notification.condition.wait(lock, [&notification]() { return notification.count > 0; });
+  } else {
+    notification.condition.wait_for(lock, std::chrono::milliseconds(ticks), [&notification]() { return notification.count > 0; });
+  }
+
+  uint32_t count = notification.count;
+  if (count > 0) {
+    notification.count = clearOnExit ? 0 : count - 1;
+  }
+  return count;
+}
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex() { return new std::timed_mutex(); }
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks)
+{
+  return semaphore->try_lock_for(std::chrono::milliseconds(ticks)) ? pdTRUE : pdFALSE;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+  semaphore->unlock();
+  return pdTRUE;
+}
+
+#endif
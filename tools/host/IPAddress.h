@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __HOST_IP_ADDRESS_H__
+#define __HOST_IP_ADDRESS_H__
+
+#include "Arduino.h"
+
+class IPAddress
+{
+private:
+  uint8_t bytes[4];
+
+public:
+  IPAddress() { memset(bytes, 0, sizeof(bytes)); }
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) { bytes[0] = a; bytes[1] = b; bytes[2] = c; bytes[3] = d; }
+  IPAddress(uint32_t networkOrder) { memcpy(bytes, &networkOrder, sizeof(bytes)); }
+
+  operator uint32_t() const
+  {
+    uint32_t networkOrder;
+    memcpy(&networkOrder, bytes, sizeof(bytes));
+    return networkOrder;
+  }
+
+  uint8_t operator[](int index) const { return bytes[index]; }
+  bool operator==(const IPAddress& other) const { return memcmp(bytes, other.bytes, sizeof(bytes)) == 0; }
+
+  bool fromString(const char* address)
+  {
+    unsigned int a, b, c, d;
+    if (sscanf(address, "%u.%u.%u.%u", &a, &b, &c, &d) != 4) {
+      return false;
+    }
+    bytes[0] = a; bytes[1] = b; bytes[2] = c; bytes[3] = d;
+    return true;
+  }
+
+  String toString() const
+  {
+    return String((int)bytes[0])+"."+String((int)bytes[1])+"."+String((int)bytes[2])+"."+String((int)bytes[3]);
+  }
+};
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __HOST_LINK_EMULATOR_H__
+#define __HOST_LINK_EMULATOR_H__
+
+#include <netinet/in.h>
+
+#include <functional>
+#include <map>
+#include <vector>
+
+/**
+ * Impairs packets of one direction: loss (Bernoulli, Gilbert-Elliott or a recorded trace),
+ * delay with jitter, reordering and duplication. All decisions come from a seeded generator
+ * so the same seed and packet sequence give the same result.
+ */
+class LinkEmulator
+{
+public:
+  enum LossModel { NONE, BERNOULLI, GILBERT_ELLIOTT, TRACE };
+
+  struct Packet
+  {
+    std::vector<uint8_t> data;
+    sockaddr_in target;
+  };
+
+  struct Stats
+  {
+    uint32_t submitted = 0;
+    uint32_t lost = 0;
+    uint32_t duplicated = 0;
+    uint32_t reordered = 0;
+  };
+
+private:
+  struct TraceEntry
+  {
+    bool lost;
+    uint32_t delayMicros;
+  };
+
+  LossModel lossModel = NONE;
+  float lossRate = 0;
+  // Gilbert-Elliott: transition probabilities and loss rate per state
+  float goodToBad = 0;
+  float badToGood = 1;
+  float lossGood = 0;
+  float lossBad = 1;
+  bool inBadState = false;
+  std::vector<TraceEntry> trace;
+  size_t tracePosition = 0;
+
+  uint32_t delayMicros = 0;
+  uint32_t jitterMicros = 0;
+  float reorderRate = 0;
+  float duplicateRate = 0;
+
+  uint64_t randomState = 1;
+  std::multimap<int64_t, Packet> pending; // by delivery time; equal times keep their order
+  Stats stats;
+
+public:
+  void setSeed(uint64_t seed)
+  {
+    randomState = seed != 0 ? seed : 1;
+  }
+
+  void setBernoulli(float rate)
+  {
+    lossModel = BERNOULLI;
+    lossRate = rate;
+  }
+
+  void setGilbertElliott(float pGoodToBad, float pBadToGood, float lossInGood, float lossInBad)
+  {
+    lossModel = GILBERT_ELLIOTT;
+    goodToBad = pGoodToBad;
+    badToGood = pBadToGood;
+    lossGood = lossInGood;
+    lossBad = lossInBad;
+  }
+
+  /**
+   * Lines of "<0|1> [delay micros]"; 1 means lost. Replayed in a loop.
+   */
+  bool loadTrace(const char* fileName)
+  {
+    FILE* file = fopen(fileName, "r");
+    if (file == NULL) {
+      perror(fileName);
+      return false;
+    }
+
+    trace.clear();
+    char line[64];
+    while (fgets(line, sizeof(line), file) != NULL) {
+      unsigned int lost = 0, delay = 0;
+      int fields = sscanf(line, "%u %u", &lost, &delay);
+      if (fields >= 1) {
+        TraceEntry entry = { lost != 0, fields >= 2 ? delay : 0 };
+        trace.push_back(entry);
+      }
+    }
+    fclose(file);
+
+    lossModel = TRACE;
+    tracePosition = 0;
+    return !trace.empty();
+  }
+
+  void setDelay(uint32_t delay, uint32_t jitter)
+  {
+    delayMicros = delay;
+    jitterMicros = jitter;
+  }
+
+  void setReorder(float rate)
+  {
+    reorderRate = rate;
+  }
+
+  void setDuplicate(float rate)
+  {
+    duplicateRate = rate;
+  }
+
+  /**
+   * Parses a loss model option: "bernoulli:RATE" or "ge:P_GOOD_BAD,P_BAD_GOOD[,LOSS_GOOD,LOSS_BAD]"
+   * or "trace:FILE".
+   */
+  bool parseLossModel(const char* text)
+  {
+    float a, b, c = 0, d = 1;
+    if (sscanf(text, "bernoulli:%f", &a) == 1) {
+      setBernoulli(a);
+      return true;
+    } else if (sscanf(text, "ge:%f,%f,%f,%f", &a, &b, &c, &d) >= 2) {
+      setGilbertElliott(a, b, c, d);
+      return true;
+    } else if (strncmp(text, "trace:", 6) == 0) {
+      return loadTrace(text + 6);
+    }
+
+    return false;
+  }
+
+  bool isActive() const
+  {
+    return lossModel != NONE || delayMicros > 0 || jitterMicros > 0 || reorderRate > 0 || duplicateRate > 0;
+  }
+
+  void submit(const uint8_t* data, size_t length, const sockaddr_in& target, int64_t now)
+  {
+    stats.submitted++;
+
+    uint32_t extraDelay = 0;
+    if (isLost(&extraDelay)) {
+      stats.lost++;
+      return;
+    }
+
+    Packet packet;
+    packet.data.assign(data, data + length);
+    packet.target = target;
+
+    int64_t delivery = now + delayMicros + extraDelay;
+    if (jitterMicros > 0) {
+      delivery += nextRandom() % (jitterMicros + 1);
+    }
+    if (reorderRate > 0 && nextUniform() < reorderRate) {
+      // held back long enough for following packets to overtake
+      delivery += 2 * (delayMicros + jitterMicros) + 1000;
+      stats.reordered++;
+    }
+
+    if (duplicateRate > 0 && nextUniform() < duplicateRate) {
+      pending.insert(std::make_pair(delivery, packet));
+      stats.duplicated++;
+    }
+    pending.insert(std::make_pair(delivery, packet));
+  }
+
+  /**
+   * Hands all packets due at now to the sender.
+   */
+  void deliverDue(int64_t now, const std::function<void(const Packet&)>& send)
+  {
+    while (!pending.empty() && pending.begin()->first <= now) {
+      send(pending.begin()->second);
+      pending.erase(pending.begin());
+    }
+  }
+
+  const Stats& getStats() const
+  {
+    return stats;
+  }
+
+private:
+  bool isLost(uint32_t* extraDelay)
+  {
+    switch (lossModel) {
+      case BERNOULLI:
+        return nextUniform() < lossRate;
+      case GILBERT_ELLIOTT:
+        if (inBadState) {
+          inBadState = nextUniform() >= badToGood;
+        } else {
+          inBadState = nextUniform() < goodToBad;
+        }
+        return nextUniform() < (inBadState ? lossBad : lossGood);
+      case TRACE: {
+        const TraceEntry& entry = trace[tracePosition];
+        tracePosition = (tracePosition + 1) % trace.size();
+        *extraDelay = entry.delayMicros;
+        return entry.lost;
+      }
+      default:
+        return false;
+    }
+  }
+
+  // xorshift64*
+  uint64_t nextRandom()
+  {
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return randomState * 2685821657736338717ULL;
+  }
+
+  float nextUniform()
+  {
+    return (nextRandom() >> 40) / (float)(1 << 24);
+  }
+};
+
+#endif
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __HOST_WIFI_H__
+#define __HOST_WIFI_H__
+
+#include "IPAddress.h"
+
+class HostWiFi
+{
+public:
+  uint8_t softAPgetStationNum() { return 1; } // there is always someone listening
+  IPAddress localIP() { return IPAddress(0, 0, 0, 0); }
+  IPAddress softAPIP() { return IPAddress(127, 0, 0, 1); }
+};
+
+static HostWiFi WiFi;
+
+#endif
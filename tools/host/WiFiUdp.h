@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __HOST_WIFI_UDP_H__
+#define __HOST_WIFI_UDP_H__
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "WiFi.h"
+#include "LinkEmulator.h"
+
+/**
+ * WiFiUDP on a plain socket. Packets to the rover broadcast address go to broadcastTarget
+ * instead (on loopback the client cannot share the rover port).
+ * Sent and received packets can be passed through link emulators.
+ */
+class WiFiUDP
+{
+public:
+  static sockaddr_in broadcastTarget;
+  static LinkEmulator downlink;
+  static LinkEmulator uplink;
+
+private:
+  int udpSocket = -1;
+  sockaddr_in packetTarget;
+  uint8_t sendBuffer[1500];
+  size_t sendLength = 0;
+  uint8_t receiveBuffer[1500];
+  size_t receiveLength = 0;
+  size_t receivePosition = 0;
+  sockaddr_in receiveSource;
+  std::vector<LinkEmulator::Packet> uplinkReady;
+
+public:
+  uint8_t begin(IPAddress address, uint16_t port)
+  {
+    udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    int enable = 1;
+    setsockopt(udpSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    setsockopt(udpSocket, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable));
+
+    sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = (uint32_t)address;
+    local.sin_port = htons(port);
+    if (bind(udpSocket, (sockaddr*)&local, sizeof(local)) < 0) {
+      perror("bind");
+      return 0;
+    }
+
+    return 1;
+  }
+
+  void stop()
+  {
+    if (udpSocket >= 0) {
+      close(udpSocket);
+      udpSocket = -1;
+    }
+  }
+
+  int beginPacket(IPAddress address, uint16_t port)
+  {
+    sendLength = 0;
+    if (address[3] == 255) {
+      packetTarget = broadcastTarget;
+      return 1;
+    }
+
+    memset(&packetTarget, 0, sizeof(packetTarget));
+    packetTarget.sin_family = AF_INET;
+    packetTarget.sin_addr.s_addr = (uint32_t)address;
+    packetTarget.sin_port = htons(port);
+    return 1;
+  }
+
+  int beginPacket(const char* host, uint16_t port)
+  {
+    IPAddress address;
+    address.fromString(host);
+    return beginPacket(address, port);
+  }
+
+  size_t write(uint8_t value)
+  {
+    return write(&value, 1);
+  }
+
+  size_t write(const uint8_t* data, size_t length)
+  {
+    size_t fitting = _min(length, sizeof(sendBuffer) - sendLength);
+    memcpy(&sendBuffer[sendLength], data, fitting);
+    sendLength += fitting;
+    return fitting;
+  }
+
+  size_t print(const char* text)
+  {
+    return write((const uint8_t*)text, strlen(text));
+  }
+
+  size_t print(const String& text)
+  {
+    return print(text.c_str());
+  }
+
+  int endPacket()
+  {
+    int64_t now = esp_timer_get_time();
+    int success = 1;
+    if (downlink.isActive()) {
+      downlink.submit(sendBuffer, sendLength, packetTarget, now);
+    } else {
+      success = sendNow(sendBuffer, sendLength, packetTarget);
+    }
+    sendLength = 0;
+
+    deliverDownlink(now);
+    return success;
+  }
+
+  int parsePacket()
+  {
+    int64_t now = esp_timer_get_time();
+    deliverDownlink(now);
+
+    if (!uplink.isActive()) {
+      return receiveNow();
+    }
+
+    while (receiveNow() > 0) {
+      uplink.submit(receiveBuffer, receiveLength, receiveSource, now);
+    }
+    uplink.deliverDue(now, [this](const LinkEmulator::Packet& packet) { uplinkReady.push_back(packet); });
+
+    if (uplinkReady.empty()) {
+      receiveLength = 0;
+      return 0;
+    }
+
+    const LinkEmulator::Packet& packet = uplinkReady.front();
+    receiveLength = packet.data.size();
+    memcpy(receiveBuffer, packet.data.data(), receiveLength);
+    receiveSource = packet.target;
+    receivePosition = 0;
+    uplinkReady.erase(uplinkReady.begin());
+    errno = 0;
+    return receiveLength;
+  }
+
+  int available()
+  {
+    return receiveLength - receivePosition;
+  }
+
+  int read()
+  {
+    return receivePosition < receiveLength ? receiveBuffer[receivePosition++] : -1;
+  }
+
+  int read(uint8_t* target, size_t length)
+  {
+    size_t readable = _min(length, receiveLength - receivePosition);
+    memcpy(target, &receiveBuffer[receivePosition], readable);
+    receivePosition += readable;
+    return readable;
+  }
+
+  void flush()
+  {
+    receivePosition = receiveLength;
+  }
+
+  IPAddress remoteIP()
+  {
+    return IPAddress((uint32_t)receiveSource.sin_addr.s_addr);
+  }
+
+  uint16_t remotePort()
+  {
+    return ntohs(receiveSource.sin_port);
+  }
+
+private:
+  int sendNow(const uint8_t* data, size_t length, const sockaddr_in& target)
+  {
+    ssize_t sent = sendto(udpSocket, data, length, 0, (sockaddr*)&target, sizeof(target));
+    return sent < 0 ? 0 : 1;
+  }
+
+  void deliverDownlink(int64_t now)
+  {
+    downlink.deliverDue(now, [this](const LinkEmulator::Packet& packet) { sendNow(packet.data.data(), packet.data.size(), packet.target); });
+  }
+
+  int receiveNow()
+  {
+    socklen_t sourceLength = sizeof(receiveSource);
+    ssize_t received = recvfrom(udpSocket, receiveBuffer, sizeof(receiveBuffer), MSG_DONTWAIT, (sockaddr*)&receiveSource, &sourceLength);
+    if (received <= 0) {
+      receiveLength = 0;
+      return 0;
+    }
+
+    errno = 0;
+    receiveLength = received;
+    receivePosition = 0;
+    return received;
+  }
+};
+
+sockaddr_in WiFiUDP::broadcastTarget;
+LinkEmulator WiFiUDP::downlink;
+LinkEmulator WiFiUDP::uplink;
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Heap statistics of the ESP-IDF allocator; the host has no meaningful numbers.
+ *
+ * "PSRAM" is emulated: allocations with MALLOC_CAP_SPIRAM count against hostExternalMemory().size
+ * (fail above it), and memcpy() from or into them takes as long as at hostExternalMemory().megabytesPerSecond
+ * (0: as fast as host memory). The frame data goes through memcpy() where the rover uses bounce buffers.
+ */
+
+#ifndef __HOST_ESP_HEAP_CAPS_H__
+#define __HOST_ESP_HEAP_CAPS_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string.h>
+#include <vector>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+struct HostExternalMemory
+{
+  struct Block
+  {
+    const byte* start;
+    size_t size;
+  };
+
+  size_t size = 4 * 1024 * 1024;
+  size_t used = 0;
+  uint32_t megabytesPerSecond = 0;
+  std::vector<Block> blocks;
+  std::atomic<uint64_t> copiedBytes{0};
+  std::atomic<uint64_t> copyNanos{0};
+
+  bool contains(const void* p)
+  {
+    for (size_t i = 0; i < blocks.size(); i++) {
+      if ((const byte*)p >= blocks[i].start && (const byte*)p < blocks[i].start + blocks[i].size) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+inline HostExternalMemory& hostExternalMemory()
+{
+  static HostExternalMemory memory;
+  return memory;
+}
+
+inline size_t heap_caps_get_free_size(uint32_t caps)
+{
+  return caps & MALLOC_CAP_SPIRAM ? hostExternalMemory().size - hostExternalMemory().used : 100000;
+}
+inline size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+  return caps & MALLOC_CAP_SPIRAM ? hostExternalMemory().size - hostExternalMemory().used : 100000;
+}
+inline size_t heap_caps_get_minimum_free_size(uint32_t caps) { return 100000; }
+
+inline void* heap_caps_malloc(size_t size, uint32_t caps)
+{
+  if ((caps & MALLOC_CAP_SPIRAM) == 0) {
+    return malloc(size);
+  }
+
+  HostExternalMemory& memory = hostExternalMemory();
+  if (memory.used + size > memory.size) {
+    return NULL;
+  }
+
+  byte* block = (byte*)malloc(size);
+  memory.used += size;
+  memory.blocks.push_back({ block, size });
+  return block;
+}
+
+inline void heap_caps_free(void* p)
+{
+  HostExternalMemory& memory = hostExternalMemory();
+  for (size_t i = 0; i < memory.blocks.size(); i++) {
+    if (memory.blocks[i].start == p) {
+      memory.used -= memory.blocks[i].size;
+      memory.blocks.erase(memory.blocks.begin() + i);
+      break;
+    }
+  }
+  free(p);
+}
+
+inline void* hostMemcpy(void* target, const void* source, size_t length)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  ::memcpy(target, source, length);
+
+  HostExternalMemory& memory = hostExternalMemory();
+  if (memory.megabytesPerSecond > 0 && (memory.contains(target) || memory.contains(source))) {
+    std::chrono::nanoseconds duration(length * 1000 / memory.megabytesPerSecond);
+    while (std::chrono::steady_clock::now() - start < duration) {
+      // busy like the CPU waiting for the cache
+    }
+    memory.copiedBytes += length;
+    memory.copyNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  return target;
+}
+
+// after the system declarations of memcpy
+#define memcpy hostMemcpy
+
+#endif
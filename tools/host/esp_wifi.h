@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The radio settings of the ESP-IDF WiFi driver; the host only keeps and checks the values.
+ */
+
+#ifndef __HOST_ESP_WIFI_H__
+#define __HOST_ESP_WIFI_H__
+
+typedef int32_t esp_err_t;
+#define ESP_OK 0
+#define ESP_ERR_INVALID_ARG 0x102
+
+typedef enum { WIFI_IF_STA, WIFI_IF_AP } wifi_interface_t;
+
+#define WIFI_PROTOCOL_11B 1
+#define WIFI_PROTOCOL_11G 2
+#define WIFI_PROTOCOL_11N 4
+
+typedef enum { WIFI_BW_HT20 = 1, WIFI_BW_HT40 } wifi_bandwidth_t;
+
+typedef enum {
+  WIFI_PHY_RATE_1M_L = 0x00, WIFI_PHY_RATE_2M_L, WIFI_PHY_RATE_5M_L, WIFI_PHY_RATE_11M_L,
+  WIFI_PHY_RATE_2M_S = 0x05, WIFI_PHY_RATE_5M_S, WIFI_PHY_RATE_11M_S,
+  WIFI_PHY_RATE_48M = 0x08, WIFI_PHY_RATE_24M, WIFI_PHY_RATE_12M, WIFI_PHY_RATE_6M,
+  WIFI_PHY_RATE_54M, WIFI_PHY_RATE_36M, WIFI_PHY_RATE_18M, WIFI_PHY_RATE_9M,
+  WIFI_PHY_RATE_MCS0_LGI = 0x10, WIFI_PHY_RATE_MCS1_LGI, WIFI_PHY_RATE_MCS2_LGI, WIFI_PHY_RATE_MCS3_LGI,
+  WIFI_PHY_RATE_MCS4_LGI, WIFI_PHY_RATE_MCS5_LGI, WIFI_PHY_RATE_MCS6_LGI, WIFI_PHY_RATE_MCS7_LGI,
+  WIFI_PHY_RATE_MCS0_SGI, WIFI_PHY_RATE_MCS1_SGI, WIFI_PHY_RATE_MCS2_SGI, WIFI_PHY_RATE_MCS3_SGI,
+  WIFI_PHY_RATE_MCS4_SGI, WIFI_PHY_RATE_MCS5_SGI, WIFI_PHY_RATE_MCS6_SGI, WIFI_PHY_RATE_MCS7_SGI,
+} wifi_phy_rate_t;
+
+struct HostWifiRadio
+{
+  uint8_t protocol = WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N;
+  wifi_bandwidth_t bandwidth = WIFI_BW_HT20;
+  int8_t power = 78;
+  bool fixedRate = false;
+  wifi_phy_rate_t rate = WIFI_PHY_RATE_1M_L;
+};
+
+inline HostWifiRadio& hostWifiRadio()
+{
+  static HostWifiRadio radio;
+  return radio;
+}
+
+inline esp_err_t esp_wifi_set_protocol(wifi_interface_t ifx, uint8_t protocol)
+{
+  hostWifiRadio().protocol = protocol;
+  return ESP_OK;
+}
+
+inline esp_err_t esp_wifi_get_protocol(wifi_interface_t ifx, uint8_t* protocol)
+{
+  *protocol = hostWifiRadio().protocol;
+  return ESP_OK;
+}
+
+inline esp_err_t esp_wifi_set_bandwidth(wifi_interface_t ifx, wifi_bandwidth_t bandwidth)
+{
+  hostWifiRadio().bandwidth = bandwidth;
+  return ESP_OK;
+}
+
+inline esp_err_t esp_wifi_get_bandwidth(wifi_interface_t ifx, wifi_bandwidth_t* bandwidth)
+{
+  *bandwidth = hostWifiRadio().bandwidth;
+  return ESP_OK;
+}
+
+inline esp_err_t esp_wifi_set_max_tx_power(int8_t power)
+{
+  if (power < 8 || power > 84) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  hostWifiRadio().power = power;
+  return ESP_OK;
+}
+
+inline esp_err_t esp_wifi_get_max_tx_power(int8_t* power)
+{
+  *power = hostWifiRadio().power;
+  return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The fixed PHY rate of the ESP-IDF WiFi driver (not in its public API).
+ */
+
+#ifndef __HOST_ESP_WIFI_INTERNAL_H__
+#define __HOST_ESP_WIFI_INTERNAL_H__
+
+#include "esp_wifi.h"
+
+inline esp_err_t esp_wifi_internal_set_fix_rate(wifi_interface_t ifx, bool en, wifi_phy_rate_t rate)
+{
+  hostWifiRadio().fixedRate = en;
+  hostWifiRadio().rate = rate;
+  return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The part of the lwIP netconn API that ZeroCopyUdpSender uses, on a plain socket.
+ * Like WiFiUDP packets go through the downlink emulator and broadcasts to broadcastTarget.
+ */
+
+#ifndef __HOST_LWIP_API_H__
+#define __HOST_LWIP_API_H__
+
+#include <vector>
+
+#include "WiFiUdp.h"
+
+typedef int8_t err_t;
+#define ERR_OK 0
+#define ERR_MEM -1
+#define ERR_WOULDBLOCK -7
+#define ERR_VAL -6
+#define ERR_USE -8
+
+typedef struct
+{
+  uint8_t bytes[4];
+} ip_addr_t;
+
+#define IP_ADDR4(ipaddr, a, b, c, d) \
+  do { (ipaddr)->bytes[0] = (a); (ipaddr)->bytes[1] = (b); (ipaddr)->bytes[2] = (c); (ipaddr)->bytes[3] = (d); } while (0)
+
+#define SOF_REUSEADDR 0x04
+#define SOF_BROADCAST 0x20
+#define ip_set_option(pcb, option) ((pcb)->so_options |= (option))
+
+enum netconn_type { NETCONN_UDP };
+
+struct udp_pcb
+{
+  uint8_t so_options;
+  uint8_t tos;
+};
+
+struct netconn
+{
+  int udpSocket;
+  udp_pcb udp;
+  struct { udp_pcb* udp; } pcb;
+};
+
+struct netbuf
+{
+  struct Part
+  {
+    const uint8_t* data;
+    uint16_t length;
+  };
+
+  std::vector<Part> parts;
+  std::vector<std::vector<uint8_t> > allocated;
+};
+
+inline netconn* netconn_new(netconn_type type)
+{
+  netconn* connection = new netconn();
+  connection->udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
+  connection->pcb.udp = &connection->udp;
+  int enable = 1;
+  setsockopt(connection->udpSocket, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable));
+  return connection;
+}
+
+static const ip_addr_t ipAddrAny = { { 0, 0, 0, 0 } };
+#define IP_ADDR_ANY (&ipAddrAny)
+
+inline err_t netconn_bind(netconn* connection, const ip_addr_t* address, uint16_t port)
+{
+  if (connection->udp.so_options & SOF_REUSEADDR) {
+    int enable = 1;
+    setsockopt(connection->udpSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  }
+
+  sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  memcpy(&local.sin_addr.s_addr, address->bytes, 4);
+  local.sin_port = htons(port);
+  return bind(connection->udpSocket, (sockaddr*)&local, sizeof(local)) == 0 ? ERR_OK : ERR_USE;
+}
+
+inline void netconn_delete(netconn* connection)
+{
+  close(connection->udpSocket);
+  delete connection;
+}
+
+#define netconn_set_nonblocking(connection, value) ((void)(value))
+
+inline netbuf* netbuf_new()
+{
+  return new netbuf();
+}
+
+inline void netbuf_delete(netbuf* buffer)
+{
+  delete buffer;
+}
+
+inline void* netbuf_alloc(netbuf* buffer, uint16_t size)
+{
+  buffer->allocated.push_back(std::vector<uint8_t>(size));
+  netbuf::Part part = { buffer->allocated.back().data(), size };
+  buffer->parts.push_back(part);
+  return buffer->allocated.back().data();
+}
+
+inline err_t netbuf_ref(netbuf* buffer, const void* data, uint16_t size)
+{
+  netbuf::Part part = { (const uint8_t*)data, size };
+  buffer->parts.push_back(part);
+  return ERR_OK;
+}
+
+inline void netbuf_chain(netbuf* head, netbuf* tail)
+{
+  head->parts.insert(head->parts.end(), tail->parts.begin(), tail->parts.end());
+  head->allocated.insert(head->allocated.end(), tail->allocated.begin(), tail->allocated.end());
+  delete tail;
+}
+
+inline err_t netconn_recv(netconn* connection, netbuf** buffer)
+{
+  uint8_t packet[1500];
+  ssize_t received = recv(connection->udpSocket, packet, sizeof(packet), MSG_DONTWAIT);
+  if (received < 0) {
+    return ERR_WOULDBLOCK;
+  }
+
+  *buffer = netbuf_new();
+  memcpy(netbuf_alloc(*buffer, received), packet, received);
+  return ERR_OK;
+}
+
+inline err_t netconn_sendto(netconn* connection, netbuf* buffer, const ip_addr_t* address, uint16_t port)
+{
+  // like the WiFi driver: chained buffers end up in one transmit buffer
+  std::vector<uint8_t> packet;
+  for (size_t i = 0; i < buffer->parts.size(); i++) {
+    packet.insert(packet.end(), buffer->parts[i].data, buffer->parts[i].data + buffer->parts[i].length);
+  }
+
+  sockaddr_in target;
+  if (address->bytes[3] == 255) {
+    target = WiFiUDP::broadcastTarget;
+  } else {
+    memset(&target, 0, sizeof(target));
+    target.sin_family = AF_INET;
+    memcpy(&target.sin_addr.s_addr, address->bytes, 4);
+    target.sin_port = htons(port);
+  }
+
+  if (WiFiUDP::downlink.isActive()) {
+    // delivered by the WiFiUDP of the server
+    WiFiUDP::downlink.submit(packet.data(), packet.size(), target, esp_timer_get_time());
+    return ERR_OK;
+  }
+
+  int tos = connection->udp.tos;
+  setsockopt(connection->udpSocket, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+  ssize_t sent = sendto(connection->udpSocket, packet.data(), packet.size(), 0, (sockaddr*)&target, sizeof(target));
+  return sent < 0 ? ERR_MEM : ERR_OK;
+}
+
+#endif
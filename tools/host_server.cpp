@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Runs the rover's UdpImageServer on Linux with synthetic frames instead of the camera.
+ * Its "broadcast" packets go to the given client address (default 127.0.0.1:1511).
+ *
+ * Build: g++ -O2 -std=c++11 -Itools/host -I. -include Arduino.h -o host_server tools/host_server.cpp -lpthread
+ * Run:   ./host_server [--port 1510] [--client 127.0.0.1:1511] [--fps 15] [--size 20000] [--seconds 60] [--static 1] [--noise 20] [--spi-mhz 8]
+ *                      [--external 1] [--psram-mbps 20]
+ *   and: ./rover_client --rover 127.0.0.1 --listen 1511
+ *
+ * Link impairment (downlink: server to client) for testing the repair path:
+ *   --loss bernoulli:0.05 | ge:0.01,0.3[,0,0.8] | trace:FILE
+ *   --delay MS --jitter MS --reorder RATE --duplicate RATE --seed N
+ *   --uplink-loss RATE  (Bernoulli loss of the packets from the client)
+ */
+
+#include <WiFi.h>
+
+#include "UdpImageServer.h"
+#include "ContinuousControl.h"
+#include "StepperMotors.h"
+#include "FrameWriter.h"
+#include "VoltageSampler.h"
+#include "WifiLinkSettings.h"
+
+/**
+ * Stands in for AsyncArducam: writes a frame of random content into the older buffer,
+ * growing it at the speed of the SPI copy from the camera FIFO.
+ *
+ * The content has restart markers like an OV2640 jpeg: SEGMENTS entropy-coded segments whose lengths
+ * follow the scene (the same for a parked camera). Sensor noise (--noise, per mille) changes every
+ * segment length a little and every byte of the content.
+ * Like the SPI reads on the rover the frame comes in chunks through an internal buffer (the "FIFO");
+ * with --psram-mbps, copies into external buffers take as long as into PSRAM.
+ */
+class SyntheticCamera : public Task
+{
+private:
+  SyncedMemoryBuffer *buffer1;
+  SyncedMemoryBuffer *buffer2;
+  uint16_t frameMillis;
+  uint32_t frameSize;
+  uint16_t spiMhz;
+  bool staticScene;
+  uint16_t noisePerMille;
+  static const uint8_t SEGMENTS = 40;
+  byte* fifo;
+  FrameWriter writer;
+  byte header[700];
+  uint16_t headerLength = 0;
+
+  /**
+   * The segments an OV2640 jpeg starts with; content is arbitrary but the same for every frame.
+   */
+  void addSegment(byte marker, uint16_t length)
+  {
+    header[headerLength++] = 0xff;
+    header[headerLength++] = marker;
+    header[headerLength++] = (byte)(length >> 8);
+    header[headerLength++] = (byte)length;
+    for (uint16_t i = 2; i < length; i++) {
+      header[headerLength++] = (byte)(i * 31 + marker);
+    }
+  }
+
+public:
+  SyntheticCamera(SyncedMemoryBuffer* mb1, SyncedMemoryBuffer* mb2, uint16_t fps, uint32_t size, uint16_t mhz, bool parked, uint16_t noise)
+  {
+    staticScene = parked;
+    noisePerMille = noise;
+    spiMhz = mhz;
+
+    header[headerLength++] = 0xff;
+    header[headerLength++] = 0xd8;
+    addSegment(0xe0, 16); // APP0
+    addSegment(0xdb, 67); // DQT luminance
+    addSegment(0xdb, 67); // DQT chrominance
+    addSegment(0xc0, 17); // SOF0
+    addSegment(0xc4, 31); // DHT
+    addSegment(0xc4, 181);
+    addSegment(0xc4, 31);
+    addSegment(0xc4, 181);
+    addSegment(0xdd, 4); // DRI
+    addSegment(0xda, 12); // SOS
+    buffer1 = mb1;
+    buffer2 = mb2;
+    frameMillis = 1000 / fps;
+    frameSize = _min(size, buffer1->maxSize());
+    fifo = (byte*)malloc(buffer1->maxSize());
+  }
+
+  virtual void run()
+  {
+    while (true) {
+      uint32_t loopStart = millis();
+      uint32_t captureStartMicros = micros();
+
+      // overwrite older one
+      bool oneIsNewer = buffer1->hasContent() && buffer1->timestamp() >= buffer2->timestamp();
+      SyncedMemoryBuffer* buffer = oneIsNewer ? buffer2 : buffer1;
+      if (buffer->isPinned()) {
+        buffer = oneIsNewer ? buffer1 : buffer2;
+      }
+
+      if (buffer->take("cam", 20 / portTICK_PERIOD_MS) && buffer->isPinned()) {
+        buffer->release();
+      } else if (buffer->isTaken()) {
+        if (staticScene && noisePerMille == 0) {
+          // the same frame every time
+          srand(1);
+        }
+
+        uint32_t size = writeFrame(fifo, buffer->maxSize());
+
+        uint32_t captureDoneMicros = micros();
+        writer.begin(buffer, size, loopStart);
+        for (uint32_t copied = 0; !writer.isDone(); ) {
+          uint16_t length = writer.chunkSize();
+          if (spiMhz > 0) {
+            delayMicroseconds(length * 8 / spiMhz);
+          }
+          memcpy(writer.chunk(), &fifo[copied], length);
+          writer.commit();
+          copied += length;
+        }
+
+        FrameTrace* trace = buffer->trace();
+        trace->captureStart = captureStartMicros;
+        trace->captureDone = captureDoneMicros;
+        trace->copyDone = micros();
+
+        writer.finish(loopStart);
+      }
+
+      waitForNextPeriod(frameMillis * 1000);
+    }
+  }
+
+private:
+  /**
+   * @return the size of the jpeg
+   */
+  uint32_t writeFrame(byte* content, uint32_t maxSize)
+  {
+    // how well each band of rows compresses; a moving camera sees another scene every frame
+    uint32_t scene = staticScene ? 1 : rand();
+    uint32_t weights[SEGMENTS];
+    uint32_t weightSum = 0;
+    for (uint8_t i = 0; i < SEGMENTS; i++) {
+      scene = scene * 1103515245 + 12345;
+      weights[i] = 50 + (scene >> 16) % 100;
+      weightSum += weights[i];
+    }
+
+    // some variation like in real jpeg sizes
+    uint32_t entropySize = frameSize - headerLength - 2 * SEGMENTS - 2;
+    if (!staticScene) {
+      entropySize -= random(entropySize / 10);
+    }
+
+    memcpy(content, header, headerLength);
+    uint32_t position = headerLength;
+    for (uint8_t i = 0; i < SEGMENTS; i++) {
+      uint32_t length = (uint64_t)entropySize * weights[i] / weightSum;
+      if (noisePerMille > 0) {
+        length = length * (1000 - noisePerMille + random(2 * noisePerMille + 1)) / 1000;
+      }
+      length = _min(length, maxSize - position - 4);
+
+      for (uint32_t j = 0; j < length; j++) {
+        byte b = random(256);
+        content[position++] = b == 0xff ? 0xfe : b; // no stuffing needed then
+      }
+      if (i + 1 < SEGMENTS) {
+        content[position++] = 0xff;
+        content[position++] = 0xd0 + i % 8;
+      }
+    }
+    content[position++] = 0xff;
+    content[position++] = 0xd9;
+
+    return position;
+  }
+};
+
+int main(int argc, char** argv)
+{
+  uint16_t port = 1510;
+  const char* client = "127.0.0.1:1511";
+  uint16_t fps = 15;
+  uint32_t size = 20000;
+  uint32_t seconds = 60;
+  uint32_t delayMillis = 0;
+  uint32_t jitterMillis = 0;
+  uint64_t seed = 1;
+  bool staticScene = false;
+  uint16_t noisePerMille = 0;
+  uint16_t spiMhz = 8;
+  bool external = false;
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--port") == 0) {
+      port = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--client") == 0) {
+      client = argv[i + 1];
+    } else if (strcmp(argv[i], "--fps") == 0) {
+      fps = _max(1, atoi(argv[i + 1]));
+    } else if (strcmp(argv[i], "--size") == 0) {
+      size = _max(16, atoi(argv[i + 1]));
+    } else if (strcmp(argv[i], "--seconds") == 0) {
+      seconds = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--spi-mhz") == 0) {
+      spiMhz = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--external") == 0) {
+      external = atoi(argv[i + 1]) != 0;
+    } else if (strcmp(argv[i], "--psram-mbps") == 0) {
+      hostExternalMemory().megabytesPerSecond = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--static") == 0) {
+      staticScene = atoi(argv[i + 1]) != 0;
+    } else if (strcmp(argv[i], "--noise") == 0) {
+      noisePerMille = _min(500, atoi(argv[i + 1]));
+    } else if (strcmp(argv[i], "--loss") == 0) {
+      if (!WiFiUDP::downlink.parseLossModel(argv[i + 1])) {
+        fprintf(stderr, "Illegal loss model %s\n", argv[i + 1]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--delay") == 0) {
+      delayMillis = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--jitter") == 0) {
+      jitterMillis = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--reorder") == 0) {
+      WiFiUDP::downlink.setReorder(atof(argv[i + 1]));
+    } else if (strcmp(argv[i], "--duplicate") == 0) {
+      WiFiUDP::downlink.setDuplicate(atof(argv[i + 1]));
+    } else if (strcmp(argv[i], "--seed") == 0) {
+      seed = strtoull(argv[i + 1], NULL, 10);
+    } else if (strcmp(argv[i], "--uplink-loss") == 0) {
+      WiFiUDP::uplink.setBernoulli(atof(argv[i + 1]));
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  String clientAddress = client;
+  int colon = clientAddress.indexOf(':');
+  IPAddress clientIp;
+  if (colon < 0 || !clientIp.fromString(clientAddress.substring(0, colon).c_str())) {
+    fprintf(stderr, "Client must be given as address:port\n");
+    return 1;
+  }
+  WiFiUDP::broadcastTarget.sin_family = AF_INET;
+  WiFiUDP::broadcastTarget.sin_addr.s_addr = (uint32_t)clientIp;
+  WiFiUDP::broadcastTarget.sin_port = htons(clientAddress.substring(colon + 1).toInt());
+
+  WiFiUDP::downlink.setDelay(delayMillis * 1000, jitterMillis * 1000);
+  WiFiUDP::downlink.setSeed(seed);
+  WiFiUDP::uplink.setSeed(seed + 1);
+
+  SyncedMemoryBuffer serverBufferOne;
+  SyncedMemoryBuffer serverBufferOther;
+  if (!external || !SyncedMemoryBuffer::setupExternal(&serverBufferOne, &serverBufferOther, EXTERNAL_BUFFER_SIZE)) {
+    serverBufferOne.setup();
+    serverBufferOther.setup();
+  }
+
+  StepperMotors motor;
+  VoltageSampler voltageSampler;
+  WifiLinkSettings linkSettings;
+  ContinuousControl control(&motor, &voltageSampler, &linkSettings);
+  UdpImageServer imageServer(port, &control);
+  SyntheticCamera camera(&serverBufferOne, &serverBufferOther, fps, size, spiMhz, staticScene, noisePerMille);
+
+  motor.start("motor", 5);
+  voltageSampler.start("voltage", 1, 2000);
+  camera.start("cam", 4, 4000);
+  imageServer.begin();
+
+  Serial.println("Host server on port "+String(port)+" sending to "+clientAddress);
+
+  uint32_t start = millis();
+  while (millis() - start < seconds * 1000UL) {
+    uint32_t now = millis();
+    imageServer.drive(&serverBufferOne, &serverBufferOther);
+
+    uint16_t passed = millis() - now;
+    if (passed < 5) {
+      delay(5 - passed);
+    }
+  }
+
+  const LinkEmulator::Stats& down = WiFiUDP::downlink.getStats();
+  const LinkEmulator::Stats& up = WiFiUDP::uplink.getStats();
+  printf("\nCamera periods %s", camera.periodStats().toString().c_str());
+  printf("\nMotor commands %s", motor.getCommandStats().c_str());
+  if (serverBufferOne.isExternal()) {
+    uint64_t copiedBytes = hostExternalMemory().copiedBytes;
+    printf("\nExternal memory: %.1f MB copied in %.1f ms", copiedBytes / 1e6, hostExternalMemory().copyNanos / 1e6);
+  }
+  printf("\nLink down: %u packets %u lost %u duplicated %u reordered; up: %u packets %u lost\n",
+    down.submitted, down.lost, down.duplicated, down.reordered, up.submitted, up.lost);
+
+  Serial.flush();
+  _exit(0); // the tasks never end
+}
@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Fuzzes and benchmarks the HttpRequestParser of ImageServer on Linux.
+ *
+ * Fuzzing mutates typical requests (seeded) and feeds them in random pieces; the result must
+ * not depend on the piece sizes and the parsed values must stay inside their buffers.
+ * The benchmark reports parsed bytes per microsecond.
+ *
+ * Build: g++ -O2 -std=c++11 -I. -o http_parser_bench tools/http_parser_bench.cpp
+ * Run:   ./http_parser_bench [fuzz iterations] [seed]
+ *
+ * With libFuzzer instead:
+ *   clang++ -O1 -g -std=c++11 -fsanitize=fuzzer,address -DHTTP_PARSER_LIBFUZZER -I. -o http_parser_fuzz tools/http_parser_bench.cpp
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "HttpRequestParser.h"
+
+struct ParseOutcome
+{
+  HttpRequestParser::Result result;
+  uint32_t consumed;
+  std::string method;
+  std::string target;
+  bool keepAlive;
+
+  bool operator==(const ParseOutcome& other) const
+  {
+    return result == other.result && consumed == other.consumed && method == other.method
+      && target == other.target && keepAlive == other.keepAlive;
+  }
+};
+
+static ParseOutcome parseInPieces(const std::string& request, const std::vector<uint32_t>& pieces)
+{
+  HttpRequestParser parser;
+  ParseOutcome outcome;
+  outcome.result = HttpRequestParser::NEED_MORE;
+  outcome.consumed = 0;
+
+  size_t piece = 0;
+  while (outcome.consumed < request.size() && outcome.result == HttpRequestParser::NEED_MORE) {
+    uint32_t length = std::min<uint32_t>(pieces.empty() ? request.size() : pieces[piece++ % pieces.size()], request.size() - outcome.consumed);
+    uint32_t consumed = 0;
+    outcome.result = parser.feed(&request[outcome.consumed], length, &consumed);
+    outcome.consumed += consumed;
+  }
+
+  outcome.method = parser.method();
+  outcome.target = parser.target();
+  outcome.keepAlive = parser.keepAlive();
+  return outcome;
+}
+
+static bool checkOne(const std::string& request, const std::vector<uint32_t>& pieces)
+{
+  ParseOutcome whole = parseInPieces(request, std::vector<uint32_t>());
+  ParseOutcome split = parseInPieces(request, pieces);
+  std::vector<uint32_t> single(1, 1);
+  ParseOutcome bytewise = parseInPieces(request, single);
+
+  if (!(whole == split) || !(whole == bytewise)) {
+    fprintf(stderr, "Different results for pieces of: %s\n", request.c_str());
+    return false;
+  }
+
+  if (whole.method.size() >= 8 || whole.target.size() >= 128) {
+    fprintf(stderr, "Value too long for: %s\n", request.c_str());
+    return false;
+  }
+
+  if (whole.result == HttpRequestParser::COMPLETE && (whole.method.empty() || whole.target.empty())) {
+    fprintf(stderr, "Complete without request line: %s\n", request.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+#ifdef HTTP_PARSER_LIBFUZZER
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+  std::string request((const char*)data, size);
+  std::vector<uint32_t> pieces;
+  pieces.push_back(1 + size % 7);
+  if (!checkOne(request, pieces)) {
+    abort();
+  }
+  return 0;
+}
+
+#else
+
+static const char* SAMPLES[] = {
+  "GET / HTTP/1.1\r\nHost: 192.168.151.1\r\nConnection: keep-alive\r\n\r\n",
+  "GET /move 500 750 HTTP/1.1\r\nHost: 192.168.151.1\r\n\r\n",
+  "GET /image_s HTTP/1.0\r\n\r\n",
+  "GET /status HTTP/1.1\r\nUser-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:60.0) Gecko/20100101 Firefox/60.0\r\nAccept: */*\r\nConnection: close\r\n\r\n",
+  "\r\nGET /path 0 500 1000 200 500 500 HTTP/1.1\nConnection: Keep-Alive\n\n",
+};
+
+static uint64_t randomState = 1;
+
+static uint32_t nextRandom()
+{
+  randomState ^= randomState >> 12;
+  randomState ^= randomState << 25;
+  randomState ^= randomState >> 27;
+  return (uint32_t)((randomState * 2685821657736338717ULL) >> 32);
+}
+
+static std::string mutate(std::string request)
+{
+  uint32_t mutations = nextRandom() % 8;
+  for (uint32_t i = 0; i < mutations; i++) {
+    uint32_t position = request.empty() ? 0 : nextRandom() % request.size();
+    switch (nextRandom() % 5) {
+      case 0: // flip
+        if (!request.empty()) {
+          request[position] = (char)nextRandom();
+        }
+        break;
+      case 1: // insert a special char
+        request.insert(position, 1, " \r\n:\0"[nextRandom() % 5]);
+        break;
+      case 2: // delete
+        if (!request.empty()) {
+          request.erase(position, 1 + nextRandom() % 4);
+        }
+        break;
+      case 3: // blow up
+        request.insert(position, nextRandom() % 300, 'a');
+        break;
+      case 4: // truncate
+        request.resize(position);
+        break;
+    }
+  }
+  return request;
+}
+
+static bool fuzz(uint32_t iterations)
+{
+  const size_t sampleCount = sizeof(SAMPLES) / sizeof(SAMPLES[0]);
+  for (uint32_t i = 0; i < iterations; i++) {
+    std::string request = mutate(SAMPLES[nextRandom() % sampleCount]);
+
+    std::vector<uint32_t> pieces;
+    uint32_t pieceCount = 1 + nextRandom() % 5;
+    for (uint32_t p = 0; p < pieceCount; p++) {
+      pieces.push_back(1 + nextRandom() % 64);
+    }
+
+    if (!checkOne(request, pieces)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void benchmark()
+{
+  const size_t sampleCount = sizeof(SAMPLES) / sizeof(SAMPLES[0]);
+  const uint32_t rounds = 200000;
+  uint64_t bytes = 0;
+  uint32_t completed = 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  HttpRequestParser parser;
+  for (uint32_t i = 0; i < rounds; i++) {
+    const char* request = SAMPLES[i % sampleCount];
+    uint32_t length = strlen(request);
+    uint32_t consumed = 0;
+    parser.reset();
+    if (parser.feed(request, length, &consumed) == HttpRequestParser::COMPLETE) {
+      completed++;
+    }
+    bytes += consumed;
+  }
+  double micros = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count() / 1000.0;
+
+  printf("parsed %u requests, %llu bytes in %.0f us: %.1f bytes/us\n", completed, (unsigned long long)bytes, micros, bytes / micros);
+}
+
+int main(int argc, char** argv)
+{
+  uint32_t iterations = argc > 1 ? atoi(argv[1]) : 100000;
+  randomState = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+
+  if (!fuzz(iterations)) {
+    return 1;
+  }
+  printf("fuzzed %u requests\n", iterations);
+
+  benchmark();
+  return 0;
+}
+
+#endif
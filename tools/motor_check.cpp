@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Runs the StepperMotors task on Linux and checks when the wheels turn (by the step tones it writes):
+ * moves end at their end time also with a trajectory point queued far ahead, a move ends the points
+ * requested before it, and the last point holds its speeds for a while.
+ *
+ * Build: g++ -O2 -std=c++11 -Itools/host -I. -include Arduino.h -o motor_check tools/motor_check.cpp -lpthread
+ * Run:   ./motor_check
+ */
+
+#include "StepperMotors.h"
+
+static const uint8_t RIGHT_CHANNEL = 0;
+static const uint8_t LEFT_CHANNEL = 2;
+
+static int failures = 0;
+
+static void check(bool good, const char* what)
+{
+  printf("%s %s\n", good ? "ok  " : "FAIL", what);
+  if (!good) {
+    failures++;
+  }
+}
+
+static bool isTurning()
+{
+  return hostLedcTones()[RIGHT_CHANNEL] != 0 || hostLedcTones()[LEFT_CHANNEL] != 0;
+}
+
+static void sleepUntil(uint32_t start, uint32_t offset)
+{
+  int32_t left = start + offset - millis();
+  if (left > 0) {
+    delay(left);
+  }
+}
+
+int main()
+{
+  StepperMotors motor;
+  motor.setup(1, 2, 3, 4, 5, 6, 100, 800);
+  motor.start("motor", 5);
+  delay(20);
+
+  // a short move, then a point far ahead: the move must still end at its end time
+  uint32_t start = millis();
+  motor.requestForward(0.5, 100);
+  motor.requestTrajectoryPoint(start + 1500, 0.3, 0.3);
+  sleepUntil(start, 50);
+  check(isTurning(), "move runs");
+  sleepUntil(start, 300);
+  check(!isTurning(), "move ends before a far trajectory point");
+  sleepUntil(start, 1600);
+  check(isTurning(), "last point drives with its speeds");
+  sleepUntil(start, 1500 + 1000 + 200);
+  check(!isTurning(), "last point holds only for a while");
+
+  // a point requested before a move is ended by it
+  start = millis();
+  motor.requestTrajectoryPoint(start + 50, 0.9, 0.9);
+  motor.requestForward(0.2, 300);
+  sleepUntil(start, 20);
+  double moveTone = hostLedcTones()[RIGHT_CHANNEL];
+  sleepUntil(start, 150);
+  check(moveTone != 0 && hostLedcTones()[RIGHT_CHANNEL] == moveTone, "move ends the earlier points");
+  sleepUntil(start, 450);
+  check(!isTurning(), "move ends at its end time");
+
+  printf("%d failures\n", failures);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,713 @@
+/*
+ * Copyright (C) 2018 Lakoja on github.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Linux reference client for the UDP image protocol of the rover.
+ *
+ * Reassembles the 'RI' packets into frames and requests missing packets with 'MN' like the
+ * Android client. Announces with 'MH' that it keeps the JPEG headers sent as 'RH'; frames
+ * then come as 'RJ' packets without the header, which is spliced back on here (while no
+ * client without 'MH' sends to the rover). Reports fps, packet loss, repair success and frame age; the age is taken
+ * relative to the capture start on the rover with clocks synchronized by 'TP' pings.
+ * Optionally sends 'CT' control commands at a fixed rate and measures their round trip.
+ * Sends an 'MR' receiver report every second (fps, loss, jitter, newest complete frame, decode time).
+ * With --link the radio settings of the rover are changed first (ie "rate 54m power 15"); runs with
+ * different settings then compare by their goodput.
+ *
+ * Against the rover:  ./rover_client --rover 192.168.151.1
+ * Against host_server (loopback): ./rover_client --rover 127.0.0.1 --listen 1511
+ *
+ * Build: g++ -O2 -std=c++11 -o rover_client tools/rover_client.cpp
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+const uint16_t ROVER_PORT = 1510;
+const uint32_t PING_INTERVAL_MICROS = 200000;
+const size_t SYNC_WINDOW = 16;
+const uint32_t NACK_INTERVAL_MICROS = 30000;
+const uint32_t STALLED_FRAME_MICROS = 30000;
+const uint8_t MAX_NACKS = 3;
+const uint32_t HEADER_REQUEST_MICROS = 1000000;
+const uint16_t DATA_SIZE = 1200;
+const uint32_t REPORT_INTERVAL_MICROS = 1000000;
+const uint8_t TOS_CONTROL = 0xc0; // IP TOS byte: DSCP 48 (CS6) << 2
+
+int64_t nowMicros()
+{
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+uint32_t readUint32(const uint8_t* source)
+{
+  return ((uint32_t)source[0] << 24) | ((uint32_t)source[1] << 16) | ((uint32_t)source[2] << 8) | source[3];
+}
+
+uint64_t readUint64(const uint8_t* source)
+{
+  return ((uint64_t)readUint32(source) << 32) | readUint32(&source[4]);
+}
+
+void writeUint32(uint8_t* target, uint32_t value)
+{
+  for (int i = 0; i < 4; i++) {
+    target[i] = (uint8_t)(value >> (24 - 8 * i));
+  }
+}
+
+void writeUint64(uint8_t* target, uint64_t value)
+{
+  writeUint32(target, (uint32_t)(value >> 32));
+  writeUint32(&target[4], (uint32_t)value);
+}
+
+/**
+ * NTP style offset estimation; uses the sample with the smallest round trip of the recent ones.
+ */
+class ClockSync
+{
+private:
+  struct Sample
+  {
+    int64_t offset;
+    int64_t roundTrip;
+  };
+
+  std::deque<Sample> samples;
+
+public:
+  void addExchange(int64_t clientSend, int64_t roverReceive, int64_t roverSend, int64_t clientReceive)
+  {
+    Sample sample;
+    sample.roundTrip = (clientReceive - clientSend) - (roverSend - roverReceive);
+    sample.offset = ((roverReceive - clientSend) + (roverSend - clientReceive)) / 2;
+
+    samples.push_back(sample);
+    if (samples.size() > SYNC_WINDOW) {
+      samples.pop_front();
+    }
+  }
+
+  bool isValid() const
+  {
+    return !samples.empty();
+  }
+
+  /** rover micros - client micros */
+  int64_t offset() const
+  {
+    return best().offset;
+  }
+
+  int64_t roundTrip() const
+  {
+    return best().roundTrip;
+  }
+
+private:
+  Sample best() const
+  {
+    Sample result = { 0, 0 };
+    if (!samples.empty()) {
+      result = *std::min_element(samples.begin(), samples.end(),
+        [](const Sample& a, const Sample& b) { return a.roundTrip < b.roundTrip; });
+    }
+    return result;
+  }
+};
+
+class LatencyStats
+{
+private:
+  std::vector<int64_t> values;
+
+public:
+  void add(int64_t micros)
+  {
+    values.push_back(micros);
+  }
+
+  std::string toString()
+  {
+    if (values.empty()) {
+      return "-";
+    }
+
+    std::vector<int64_t> sorted(values);
+    std::sort(sorted.begin(), sorted.end());
+    char text[160];
+    snprintf(text, sizeof(text), "n %zu min %.1f med %.1f p90 %.1f p99 %.1f max %.1f ms",
+      sorted.size(), sorted.front() / 1000.0, at(sorted, 50) / 1000.0, at(sorted, 90) / 1000.0,
+      at(sorted, 99) / 1000.0, sorted.back() / 1000.0);
+    return text;
+  }
+
+private:
+  static int64_t at(const std::vector<int64_t>& sorted, int percent)
+  {
+    return sorted[std::min(sorted.size() - 1, sorted.size() * percent / 100)];
+  }
+};
+
+struct ClientOptions
+{
+  const char* roverHost = "192.168.151.1";
+  uint16_t roverPort = ROVER_PORT;
+  uint16_t listenPort = ROVER_PORT; // the rover broadcasts to its own port
+  uint32_t seconds = 30;
+  uint16_t controlRate = 0; // control commands per second
+  const char* linkSettings = NULL;
+  bool nack = true;
+};
+
+class RoverClient
+{
+private:
+  struct FrameArrival
+  {
+    uint16_t packetCountTotal = 0;
+    uint16_t packetsReceived = 0;
+    uint16_t packetsBeforeNack = 0;
+    uint16_t packetsRequested = 0;
+    uint16_t packetsRepaired = 0;
+    uint32_t bytes = 0;
+    std::vector<bool> received;
+    std::vector<bool> requested;
+    int64_t firstArrival = 0;
+    int64_t lastArrival = 0;
+    int64_t lastNack = 0;
+    uint8_t nackCount = 0;
+    bool complete = false;
+    bool closed = false; // a newer frame started: no more original packets expected
+    bool withoutHeader = false;
+    uint8_t headerId = 0;
+    std::vector<uint8_t> data;
+  };
+
+  struct Counters
+  {
+    uint32_t framesSeen = 0;
+    uint32_t framesComplete = 0;
+    uint64_t completeBytes = 0;
+    uint64_t packetsExpected = 0;
+    uint64_t packetsBeforeNack = 0;
+    uint64_t packetsRequested = 0;
+    uint64_t packetsRepaired = 0;
+    uint64_t duplicates = 0;
+    uint32_t unchangedFrames = 0;
+    uint32_t framesSpliced = 0;
+    uint32_t framesBroken = 0;
+    uint32_t headerBytesSaved = 0;
+    uint32_t controlSent = 0;
+    uint32_t controlAnswered = 0;
+    uint32_t framesDecoded = 0;
+    uint64_t decodeMicros = 0;
+    uint32_t reportsSent = 0;
+    uint64_t closedPacketsExpected = 0;
+    uint64_t closedPacketsBeforeNack = 0;
+  };
+
+  ClientOptions options;
+  int udpSocket = -1;
+  sockaddr_in roverAddress;
+  ClockSync clockSync;
+  std::map<uint32_t, FrameArrival> frames;
+  std::map<uint8_t, std::vector<uint8_t> > headers;
+  int64_t lastHeaderRequest = 0;
+  Counters counters;
+  LatencyStats firstPacketAge;
+  LatencyStats completeFrameAge;
+  LatencyStats controlRoundTrip;
+  std::deque<int64_t> controlSendTimes;
+  int64_t lastPingSent = 0;
+  int64_t lastControlSent = 0;
+  int64_t startTime = 0;
+  int64_t lastReportSent = 0;
+  Counters reportedCounters; // at the last report
+  double jitter = 0; // micros; like RTP over the first packets of frames against the frame timestamps
+  int64_t lastTransit = 0;
+  uint32_t highestCompleteFrame = 0;
+
+public:
+  bool setup(const ClientOptions& clientOptions)
+  {
+    options = clientOptions;
+
+    udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udpSocket < 0) {
+      perror("socket");
+      return false;
+    }
+
+    int enable = 1;
+    setsockopt(udpSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    setsockopt(udpSocket, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable));
+    // everything sent is small and urgent (commands, NACKs, pings): WMM voice like the answers of the rover
+    int tos = TOS_CONTROL;
+    setsockopt(udpSocket, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+
+    sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = htons(options.listenPort);
+    if (bind(udpSocket, (sockaddr*)&local, sizeof(local)) < 0) {
+      perror("bind");
+      return false;
+    }
+
+    memset(&roverAddress, 0, sizeof(roverAddress));
+    roverAddress.sin_family = AF_INET;
+    roverAddress.sin_port = htons(options.roverPort);
+    if (inet_pton(AF_INET, options.roverHost, &roverAddress.sin_addr) != 1) {
+      fprintf(stderr, "Illegal rover address %s\n", options.roverHost);
+      return false;
+    }
+
+    return true;
+  }
+
+  void run()
+  {
+    startTime = nowMicros();
+    int64_t lastOut = startTime;
+
+    if (options.linkSettings != NULL) {
+      sendLinkSettings();
+    }
+
+    while (nowMicros() - startTime < (int64_t)options.seconds * 1000000) {
+      int64_t now = nowMicros();
+      if (now - lastPingSent >= PING_INTERVAL_MICROS) {
+        sendPing();
+      }
+
+      if (headers.empty() && now - lastHeaderRequest >= HEADER_REQUEST_MICROS) {
+        requestHeader(0);
+      }
+
+      if (options.controlRate > 0 && now - lastControlSent >= 1000000 / options.controlRate) {
+        sendControl();
+      }
+
+      if (now - lastReportSent >= REPORT_INTERVAL_MICROS) {
+        sendReport(now);
+      }
+
+      pollfd pfd = { udpSocket, POLLIN, 0 };
+      if (poll(&pfd, 1, 5) > 0) {
+        uint8_t packet[1500];
+        ssize_t len = recv(udpSocket, packet, sizeof(packet), 0);
+        if (len > 0) {
+          handlePacket(packet, len, nowMicros());
+        }
+      }
+
+      if (options.nack) {
+        checkStalledFrame(nowMicros());
+      }
+
+      if (now - lastOut > 5000000) {
+        printReport();
+        lastOut = now;
+      }
+    }
+
+    while (!frames.empty()) {
+      retireFrame(frames.begin());
+    }
+    printReport();
+  }
+
+private:
+  void send(const uint8_t* packet, size_t len)
+  {
+    sendto(udpSocket, packet, len, 0, (sockaddr*)&roverAddress, sizeof(roverAddress));
+  }
+
+  void sendPing()
+  {
+    lastPingSent = nowMicros();
+
+    uint8_t packet[22];
+    packet[0] = 'T';
+    packet[1] = 'P';
+    writeUint64(&packet[2], lastPingSent);
+    writeUint64(&packet[10], clockSync.offset());
+    writeUint32(&packet[18], (uint32_t)clockSync.roundTrip());
+    send(packet, sizeof(packet));
+  }
+
+  void requestHeader(uint8_t headerId)
+  {
+    lastHeaderRequest = nowMicros();
+
+    uint8_t packet[3] = { 'M', 'H', headerId };
+    send(packet, sizeof(packet));
+  }
+
+  void sendControl()
+  {
+    lastControlSent = nowMicros();
+
+    // standing still: can also be used with a real rover
+    const char* command = "CTmove 500 500";
+    send((const uint8_t*)command, strlen(command));
+
+    controlSendTimes.push_back(lastControlSent);
+    counters.controlSent++;
+  }
+
+  /**
+   * Loss is taken over the frames closed since the last report (when the next frame started).
+   */
+  void sendReport(int64_t now)
+  {
+    double seconds = lastReportSent > 0 ? (now - lastReportSent) / 1000000.0 : (now - startTime) / 1000000.0;
+    lastReportSent = now;
+
+    uint32_t framesComplete = counters.framesComplete - reportedCounters.framesComplete;
+    uint64_t packetsExpected = counters.closedPacketsExpected - reportedCounters.closedPacketsExpected;
+    uint64_t packetsBeforeNack = counters.closedPacketsBeforeNack - reportedCounters.closedPacketsBeforeNack;
+    uint32_t framesDecoded = counters.framesDecoded - reportedCounters.framesDecoded;
+    uint64_t decodeMicros = counters.decodeMicros - reportedCounters.decodeMicros;
+
+    uint16_t fpsTenths = seconds > 0 ? (uint16_t)(framesComplete * 10 / seconds + 0.5) : 0;
+    uint16_t lossPerMille = packetsExpected > 0 ? (uint16_t)(1000 - packetsBeforeNack * 1000 / packetsExpected) : 0;
+
+    uint8_t packet[18];
+    packet[0] = 'M';
+    packet[1] = 'R';
+    packet[2] = (uint8_t)(fpsTenths >> 8);
+    packet[3] = (uint8_t)fpsTenths;
+    packet[4] = (uint8_t)(lossPerMille >> 8);
+    packet[5] = (uint8_t)lossPerMille;
+    writeUint32(&packet[6], (uint32_t)jitter);
+    writeUint32(&packet[10], highestCompleteFrame);
+    writeUint32(&packet[14], framesDecoded > 0 ? (uint32_t)(decodeMicros / framesDecoded) : 0);
+    send(packet, sizeof(packet));
+
+    counters.reportsSent++;
+    reportedCounters = counters;
+  }
+
+  void sendLinkSettings()
+  {
+    // answered with the settings now active (printed like every unknown 'CT')
+    std::string command = std::string("CTlink ") + options.linkSettings;
+    send((const uint8_t*)command.c_str(), command.size());
+  }
+
+  void handlePacket(const uint8_t* packet, ssize_t len, int64_t arrival)
+  {
+    if (len == 26 && packet[0] == 'T' && packet[1] == 'P') {
+      clockSync.addExchange(readUint64(&packet[2]), readUint64(&packet[10]), readUint64(&packet[18]), arrival);
+    } else if (len > 10 && packet[0] == 'R' && packet[1] == 'I') {
+      handleImagePacket(readUint32(&packet[2]), (packet[6] << 8) | packet[7], (packet[8] << 8) | packet[9], &packet[10], len - 10, false, 0, arrival);
+    } else if (len > 11 && packet[0] == 'R' && packet[1] == 'J') {
+      handleImagePacket(readUint32(&packet[2]), (packet[6] << 8) | packet[7], (packet[8] << 8) | packet[9], &packet[11], len - 11, true, packet[10], arrival);
+    } else if (len > 5 && packet[0] == 'R' && packet[1] == 'H' && len == 5 + ((packet[3] << 8) | packet[4])) {
+      headers[packet[2]].assign(&packet[5], &packet[len]);
+    } else if (len == 10 && packet[0] == 'R' && packet[1] == 'U') {
+      // the rover skipped a frame identical to the one we have
+      counters.unchangedFrames++;
+    } else if (len >= 5 && memcmp(packet, "CTOKC", 5) == 0) {
+      if (!controlSendTimes.empty()) {
+        controlRoundTrip.add(arrival - controlSendTimes.front());
+        controlSendTimes.pop_front();
+        counters.controlAnswered++;
+      }
+    } else if (len > 2 && packet[0] == 'C' && packet[1] == 'T') {
+      printf("%.*s\n", (int)len - 2, &packet[2]);
+    }
+  }
+
+  void handleImagePacket(uint32_t timestamp, uint16_t packetNumber, uint16_t packetCountTotal,
+    const uint8_t* payload, uint16_t payloadSize, bool withoutHeader, uint8_t headerId, int64_t arrival)
+  {
+    if (packetCountTotal == 0 || packetNumber >= packetCountTotal) {
+      return;
+    }
+
+    if (!frames.empty() && timestamp < frames.begin()->first) {
+      return; // already retired
+    }
+
+    FrameArrival& frame = frames[timestamp];
+    if (frame.packetCountTotal == 0) {
+      frame.packetCountTotal = packetCountTotal;
+      frame.received.assign(packetCountTotal, false);
+      frame.requested.assign(packetCountTotal, false);
+      frame.data.assign((size_t)packetCountTotal * DATA_SIZE, 0);
+      frame.withoutHeader = withoutHeader;
+      frame.headerId = headerId;
+      frame.firstArrival = arrival;
+      counters.framesSeen++;
+
+      int64_t transit = arrival - (int64_t)timestamp * 1000;
+      if (lastTransit != 0) {
+        jitter += (std::abs((double)(transit - lastTransit)) - jitter) / 16;
+      }
+      lastTransit = transit;
+
+      std::map<uint32_t, FrameArrival>::iterator current = frames.find(timestamp);
+      if (current != frames.begin()) {
+        std::map<uint32_t, FrameArrival>::iterator previous = current;
+        --previous;
+        closeFrame(previous->second);
+      }
+
+      if (clockSync.isValid()) {
+        firstPacketAge.add(age(timestamp, arrival));
+      }
+    }
+    frame.lastArrival = arrival;
+
+    if (frame.received[packetNumber]) {
+      counters.duplicates++;
+    } else {
+      frame.received[packetNumber] = true;
+      frame.packetsReceived++;
+      frame.bytes += payloadSize;
+      payloadSize = std::min(payloadSize, DATA_SIZE);
+      memcpy(&frame.data[packetNumber * DATA_SIZE], payload, payloadSize);
+      if (packetNumber == packetCountTotal - 1) {
+        frame.data.resize(packetNumber * DATA_SIZE + payloadSize);
+      }
+      if (frame.nackCount == 0) {
+        frame.packetsBeforeNack++;
+      } else if (frame.requested[packetNumber]) {
+        frame.packetsRepaired++;
+      }
+    }
+
+    if (!frame.complete && frame.packetsReceived == frame.packetCountTotal) {
+      frame.complete = true;
+      counters.framesComplete++;
+      counters.completeBytes += frame.bytes;
+      highestCompleteFrame = std::max(highestCompleteFrame, timestamp);
+
+      // splicing and checking is what the decoder of this client does
+      int64_t decodeStart = nowMicros();
+      checkJpeg(frame);
+      counters.decodeMicros += nowMicros() - decodeStart;
+      counters.framesDecoded++;
+
+      if (clockSync.isValid()) {
+        completeFrameAge.add(age(timestamp, arrival));
+      }
+    }
+
+    if (options.nack) {
+      // a newer frame started: the previous one will get no more original packets
+      std::map<uint32_t, FrameArrival>::iterator current = frames.find(timestamp);
+      if (current != frames.begin()) {
+        std::map<uint32_t, FrameArrival>::iterator previous = current;
+        --previous;
+        requestMissing(previous->first, previous->second, arrival);
+      }
+    }
+
+    while (frames.size() > 32) {
+      retireFrame(frames.begin());
+    }
+  }
+
+  /**
+   * Puts the cached header in front if needed and checks the frame has the JPEG start and end markers.
+   */
+  void checkJpeg(FrameArrival& frame)
+  {
+    std::vector<uint8_t> jpeg;
+    if (frame.withoutHeader) {
+      std::map<uint8_t, std::vector<uint8_t> >::iterator header = headers.find(frame.headerId);
+      if (header == headers.end()) {
+        counters.framesBroken++;
+        if (nowMicros() - lastHeaderRequest >= NACK_INTERVAL_MICROS) {
+          requestHeader(frame.headerId);
+        }
+        return;
+      }
+
+      jpeg = header->second;
+      counters.framesSpliced++;
+      counters.headerBytesSaved += header->second.size();
+    }
+    jpeg.insert(jpeg.end(), frame.data.begin(), frame.data.end());
+
+    // the camera FIFO length may include a few bytes after the end of the image
+    bool hasEnd = false;
+    for (size_t i = jpeg.size() >= 32 ? jpeg.size() - 32 : 0; i + 1 < jpeg.size(); i++) {
+      hasEnd = hasEnd || (jpeg[i] == 0xff && jpeg[i + 1] == 0xd9);
+    }
+
+    if (jpeg.size() < 4 || jpeg[0] != 0xff || jpeg[1] != 0xd8 || !hasEnd) {
+      counters.framesBroken++;
+    }
+  }
+
+  void checkStalledFrame(int64_t now)
+  {
+    if (frames.empty()) {
+      return;
+    }
+
+    std::map<uint32_t, FrameArrival>::iterator newest = frames.end();
+    --newest;
+    if (now - newest->second.lastArrival > STALLED_FRAME_MICROS) {
+      requestMissing(newest->first, newest->second, now);
+    }
+  }
+
+  /**
+   * Like the Android client: at most three packets per 'MN' request.
+   */
+  void requestMissing(uint32_t timestamp, FrameArrival& frame, int64_t now)
+  {
+    if (frame.complete || frame.nackCount >= MAX_NACKS || now - frame.lastNack < NACK_INTERVAL_MICROS) {
+      return;
+    }
+
+    uint8_t packet[12];
+    packet[0] = 'M';
+    packet[1] = 'N';
+    writeUint32(&packet[2], timestamp);
+    uint8_t missingCount = 0;
+    for (uint16_t num = 0; num < frame.packetCountTotal && missingCount < 3; num++) {
+      if (!frame.received[num]) {
+        packet[6 + 2 * missingCount] = (uint8_t)(num >> 8);
+        packet[7 + 2 * missingCount] = (uint8_t)num;
+        if (!frame.requested[num]) {
+          frame.requested[num] = true;
+          frame.packetsRequested++;
+        }
+        missingCount++;
+      }
+    }
+
+    if (missingCount > 0) {
+      send(packet, 6 + 2 * missingCount);
+      frame.nackCount++;
+      frame.lastNack = now;
+    }
+  }
+
+  void closeFrame(FrameArrival& frame)
+  {
+    if (!frame.closed) {
+      frame.closed = true;
+      counters.closedPacketsExpected += frame.packetCountTotal;
+      counters.closedPacketsBeforeNack += frame.packetsBeforeNack;
+    }
+  }
+
+  void retireFrame(std::map<uint32_t, FrameArrival>::iterator frame)
+  {
+    closeFrame(frame->second);
+    counters.packetsExpected += frame->second.packetCountTotal;
+    counters.packetsBeforeNack += frame->second.packetsBeforeNack;
+    counters.packetsRequested += frame->second.packetsRequested;
+    counters.packetsRepaired += frame->second.packetsRepaired;
+    frames.erase(frame);
+  }
+
+  /** Frame timestamps are rover millis at capture start */
+  int64_t age(uint32_t timestamp, int64_t arrival)
+  {
+    return arrival + clockSync.offset() - (int64_t)timestamp * 1000;
+  }
+
+  void printReport()
+  {
+    double seconds = (nowMicros() - startTime) / 1000000.0;
+    double loss = counters.packetsExpected > 0 ? 100.0 * (1 - counters.packetsBeforeNack / (double)counters.packetsExpected) : 0;
+    double repairSuccess = counters.packetsRequested > 0 ? 100.0 * counters.packetsRepaired / counters.packetsRequested : 0;
+
+    printf("%.1fs fps %.1f frames %u/%u unchanged %u loss %.2f%% repair %llu/%llu (%.1f%%) dup %llu\n",
+      seconds, counters.framesComplete / seconds, counters.framesComplete, counters.framesSeen, counters.unchangedFrames, loss,
+      (unsigned long long)counters.packetsRepaired, (unsigned long long)counters.packetsRequested, repairSuccess,
+      (unsigned long long)counters.duplicates);
+    printf("jpeg spliced %u broken %u header bytes saved %u\n", counters.framesSpliced, counters.framesBroken, counters.headerBytesSaved);
+    // the numbers to compare protocol changes with
+    printf("score goodput %.1f kbps repair efficiency %.2f\n", counters.completeBytes / 1024.0 / seconds, repairSuccess / 100);
+    printf("reports %u jitter %.2f ms\n", counters.reportsSent, jitter / 1000);
+    printf("sync rtt %.2f ms offset %lld us\n", clockSync.roundTrip() / 1000.0, (long long)clockSync.offset());
+    printf("first packet age: %s\n", firstPacketAge.toString().c_str());
+    printf("complete frame age: %s\n", completeFrameAge.toString().c_str());
+    if (options.controlRate > 0) {
+      printf("control %u/%u rtt: %s\n", counters.controlAnswered, counters.controlSent, controlRoundTrip.toString().c_str());
+    }
+  }
+};
+
+void printUsage()
+{
+  fprintf(stderr, "rover_client [--rover address] [--port port] [--listen port] [--seconds n] [--control rate] [--link settings] [--no-nack]\n");
+}
+
+int main(int argc, char** argv)
+{
+  ClientOptions options;
+
+  for (int i = 1; i < argc; i++) {
+    bool hasValue = i + 1 < argc;
+    if (strcmp(argv[i], "--no-nack") == 0) {
+      options.nack = false;
+    } else if (strcmp(argv[i], "--rover") == 0 && hasValue) {
+      options.roverHost = argv[++i];
+    } else if (strcmp(argv[i], "--port") == 0 && hasValue) {
+      options.roverPort = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--listen") == 0 && hasValue) {
+      options.listenPort = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--seconds") == 0 && hasValue) {
+      options.seconds = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--control") == 0 && hasValue) {
+      options.controlRate = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--link") == 0 && hasValue) {
+      options.linkSettings = argv[++i];
+    } else {
+      printUsage();
+      return 1;
+    }
+  }
+
+  RoverClient client;
+  if (!client.setup(options)) {
+    return 1;
+  }
+
+  client.run();
+
+  return 0;
+}